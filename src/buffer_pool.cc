@@ -0,0 +1,217 @@
+#include "buffer_pool.h"
+
+#include <algorithm>      // std::min
+#include <cerrno>         // errno
+#include <cstdint>        // uintptr_t
+#include <limits>         // std::numeric_limits
+#include <stdexcept>      // std::runtime_error, nested stuff
+#include <sstream>        // std::ostringstream
+#include <system_error>   // std::system_error
+#include <utility>        // std::swap
+
+#include <sys/mman.h>     // mmap()
+#include <unistd.h>       // sysconf()
+
+const size_t buffer_pool_t::huge_page_size = 0x200000;
+
+const size_t buffer_pool_t::default_buffer_size = 0x200000;
+
+const uint64_t buffer_pool_t::default_budget = 0x10000000;
+
+// What configure_default() set, and whether it's too late to set it.
+static size_t default_pool_buffer_size = buffer_pool_t::default_buffer_size;
+static uint64_t default_pool_budget = buffer_pool_t::default_budget;
+static std::atomic<bool> is_default_made { false };
+
+// Start out empty, holding nothing from any pool.
+buffer_pool_t::buffer_t::buffer_t() noexcept
+    : pool(nullptr), slot_idx(0), data(nullptr), size(0) {}
+
+// Take ownership of a buffer from the pool.
+buffer_pool_t::buffer_t::buffer_t(buffer_pool_t &pool, uint32_t slot_idx)
+    : pool(&pool), slot_idx(slot_idx), data(pool.slot_datas[slot_idx]),
+      size(pool.buffer_size) {}
+
+// Hand the buffer back, if we still have it.
+buffer_pool_t::buffer_t::~buffer_t() {
+  if (pool) {
+    pool->push_free(slot_idx);
+  }
+}
+
+// Move-construct, leaving the donor empty.
+buffer_pool_t::buffer_t::buffer_t(buffer_t &&that) noexcept
+    : pool(that.pool), slot_idx(that.slot_idx), data(that.data),
+      size(that.size) {
+  that.pool = nullptr;
+  that.data = nullptr;
+  that.size = 0;
+}
+
+// Move-assign by swapping, so the donor hands back whatever we had.
+buffer_pool_t::buffer_t &buffer_pool_t::buffer_t::operator=(
+    buffer_t &&that) noexcept {
+  std::swap(pool, that.pool);
+  std::swap(slot_idx, that.slot_idx);
+  std::swap(data, that.data);
+  std::swap(size, that.size);
+  return *this;
+}
+
+// Start out with every slot on the free list and none of them mapped.
+buffer_pool_t::buffer_pool_t(size_t buffer_size, uint64_t budget)
+    : free_head(0), waiter_count(0) {
+  // Buffers are a whole number of pages.  If the budget won't cover even
+  // one buffer, we make the buffers smaller.
+  auto page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  buffer_size = static_cast<size_t>(std::min<uint64_t>(buffer_size, budget));
+  buffer_size = std::max(buffer_size, page_size);
+  this->buffer_size = (buffer_size + page_size - 1) / page_size * page_size;
+  // Leave the top index free, so one more than it still fits.
+  slot_count = static_cast<uint32_t>(std::max<uint64_t>(
+      1, std::min<uint64_t>(
+          budget / this->buffer_size,
+          std::numeric_limits<uint32_t>::max() - 1)));
+  slot_datas.reset(new char *[slot_count]());
+  next_free.reset(new std::atomic<uint32_t>[slot_count]);
+  for (uint32_t slot_idx = 0; slot_idx < slot_count; ++slot_idx) {
+    next_free[slot_idx] = slot_idx + 2 <= slot_count ? slot_idx + 2 : 0;
+  }  // for
+  free_head = 1;
+}
+
+// Unmap every buffer.
+buffer_pool_t::~buffer_pool_t() {
+  for (uint32_t slot_idx = 0; slot_idx < slot_count; ++slot_idx) {
+    if (slot_datas[slot_idx]) {
+      munmap(slot_datas[slot_idx], buffer_size);
+    }
+  }  // for
+}
+
+// Take a slot off the free list, mapping its memory if this is the first
+// time it's been used.  If the list is empty, wait for a slot to be handed
+// back and try again.
+buffer_pool_t::buffer_t buffer_pool_t::acquire() {
+  for (;;) {
+    uint32_t slot_idx;
+    if (pop_free(slot_idx)) {
+      if (!slot_datas[slot_idx]) {
+        try {
+          slot_datas[slot_idx] = map_buffer();
+        } catch (...) {
+          push_free(slot_idx);
+          throw;
+        }
+      }
+      return buffer_t { *this, slot_idx };
+    }
+    // Say we're waiting before we look at the list again, so whoever
+    // hands back the next slot knows to wake us.
+    std::unique_lock<std::mutex> lock { mutex };
+    ++waiter_count;
+    freed.wait(lock, [this] {
+      return static_cast<uint32_t>(free_head.load()) != 0;
+    });
+    --waiter_count;
+  }  // for
+}
+
+// The pool split() and join() copy through.
+buffer_pool_t &buffer_pool_t::get_default() {
+  static buffer_pool_t pool { [] {
+    is_default_made = true;
+    return default_pool_buffer_size;
+  }(), default_pool_budget };
+  return pool;
+}
+
+// Set the size of the default pool's buffers and its budget.
+void buffer_pool_t::configure_default(size_t buffer_size, uint64_t budget) {
+  if (is_default_made) {
+    throw std::runtime_error {
+        "The buffer pool is already in use, so it's too late to change it." };
+  }
+  default_pool_buffer_size = buffer_size;
+  default_pool_budget = budget;
+}
+
+// Map a buffer of our size from the kernel.  If it's a whole number of
+// huge pages and the system has huge pages set aside, we use those.
+// Otherwise, we use ordinary pages, but, if the buffer is at least a huge
+// page, we align it to one and ask the kernel to back it with transparent
+// huge pages, which it's free to ignore.
+char *buffer_pool_t::map_buffer() const {
+  if (buffer_size % huge_page_size == 0) {
+    void *data = mmap(
+        nullptr, buffer_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (data != MAP_FAILED) {
+      return static_cast<char *>(data);
+    }
+  }
+  try {
+    // Map enough extra to find an aligned start within it, then give back
+    // what we don't use at either end.
+    size_t align_size = buffer_size >= huge_page_size ? huge_page_size : 0;
+    size_t map_size = buffer_size + align_size;
+    void *data = mmap(
+        nullptr, map_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == MAP_FAILED) {
+      throw std::system_error { errno, std::system_category() };
+    }
+    auto start = static_cast<char *>(data);
+    if (align_size) {
+      auto addr = reinterpret_cast<uintptr_t>(start);
+      size_t head_size = (align_size - addr % align_size) % align_size;
+      size_t tail_size = map_size - head_size - buffer_size;
+      if (head_size) {
+        munmap(start, head_size);
+      }
+      start += head_size;
+      if (tail_size) {
+        munmap(start + buffer_size, tail_size);
+      }
+      madvise(start, buffer_size, MADV_HUGEPAGE);
+    }
+    return start;
+  } catch (...) {
+    std::ostringstream msg;
+    msg << "Couldn't map a buffer of " << buffer_size << " bytes.";
+    std::throw_with_nested(std::runtime_error { msg.str() });
+  }
+}
+
+// Take a slot off the free list.
+bool buffer_pool_t::pop_free(uint32_t &slot_idx) {
+  uint64_t head = free_head.load();
+  for (;;) {
+    auto top = static_cast<uint32_t>(head);
+    if (!top) {
+      return false;
+    }
+    uint64_t new_head =
+        ((head >> 32) + 1) << 32 | next_free[top - 1].load(
+            std::memory_order_relaxed);
+    if (free_head.compare_exchange_weak(head, new_head)) {
+      slot_idx = top - 1;
+      return true;
+    }
+  }  // for
+}
+
+// Put a slot on the free list and wake anyone waiting for one.
+void buffer_pool_t::push_free(uint32_t slot_idx) {
+  uint64_t head = free_head.load();
+  uint64_t new_head;
+  do {
+    next_free[slot_idx].store(
+        static_cast<uint32_t>(head), std::memory_order_relaxed);
+    new_head = ((head >> 32) + 1) << 32 | (slot_idx + 1);
+  } while (!free_head.compare_exchange_weak(head, new_head));
+  if (waiter_count) {
+    std::lock_guard<std::mutex> lock { mutex };
+    freed.notify_one();
+  }
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <atomic>              // std::atomic
+#include <condition_variable>  // std::condition_variable
+#include <cstddef>             // size_t
+#include <cstdint>             // uint64_t
+#include <memory>              // std::unique_ptr
+#include <mutex>               // std::mutex
+
+// A pool of big, aligned buffers for copying data through, shared by every
+// thread.  Buffers are mapped straight from the kernel the first time
+// they're needed, aligned to a page, or to a huge page if they're at least
+// that big, and backed by huge pages where the system allows.  A buffer
+// handed back goes on a lock-free free list for the next thread to take.
+// The pool never holds more than its budget; once every buffer is out,
+// acquire() waits for one to come back, so a thread shouldn't hold more
+// than one buffer at a time unless the budget allows for it.
+class buffer_pool_t final {
+public:
+
+  // The size of a huge page, which is as far as we align a buffer.
+  static const size_t huge_page_size;
+
+  // The size of the buffers in the default pool, unless set otherwise.
+  static const size_t default_buffer_size;
+
+  // The most memory the default pool may hold, unless set otherwise.
+  static const uint64_t default_budget;
+
+  // A buffer borrowed from the pool.  It goes back when this is destroyed.
+  class buffer_t final {
+  public:
+
+    // Start out empty, holding nothing from any pool.
+    buffer_t() noexcept;
+
+    // Take ownership of a buffer from the pool.
+    buffer_t(buffer_pool_t &pool, uint32_t slot_idx);
+
+    // Hand the buffer back, if we still have it.
+    ~buffer_t();
+
+    // Moving is allowed; copying is not.
+    buffer_t(buffer_t &&that) noexcept;
+    buffer_t &operator=(buffer_t &&that) noexcept;
+    buffer_t(const buffer_t &) = delete;
+    buffer_t &operator=(const buffer_t &) = delete;
+
+    // The bytes of the buffer, or null if we're empty.
+    char *get_data() const noexcept { return data; }
+
+    // The size of the buffer in bytes.
+    size_t get_size() const noexcept { return size; }
+
+  private:
+
+    // The pool we came from, or null if we've been moved from.
+    buffer_pool_t *pool;
+
+    // Our place in the pool.
+    uint32_t slot_idx;
+
+    // See get_data() and get_size().
+    char *data;
+    size_t size;
+
+  };  // buffer_t
+
+  // Start out with no memory mapped, able to hand out as many buffers of
+  // the given size as fit in the budget.  If not even one fits, we make
+  // the buffers smaller, though never smaller than a page.
+  buffer_pool_t(size_t buffer_size, uint64_t budget);
+
+  // Unmap every buffer.  They should all have been handed back by now.
+  ~buffer_pool_t();
+
+  // Copying is not allowed.
+  buffer_pool_t(const buffer_pool_t &) = delete;
+  buffer_pool_t &operator=(const buffer_pool_t &) = delete;
+
+  // Borrow a buffer, waiting for one to be handed back if they're all out.
+  buffer_t acquire();
+
+  // The size of each buffer in bytes.
+  size_t get_buffer_size() const noexcept { return buffer_size; }
+
+  // The most buffers we'll hand out at once.
+  uint32_t get_buffer_count() const noexcept { return slot_count; }
+
+  // The pool split() and join() copy through.  It's made the first time
+  // it's needed.
+  static buffer_pool_t &get_default();
+
+  // Set the size of the default pool's buffers and its budget.  This must
+  // be called before anything uses the default pool, or it throws.
+  static void configure_default(size_t buffer_size, uint64_t budget);
+
+private:
+
+  // Map a buffer of our size from the kernel.
+  char *map_buffer() const;
+
+  // Take a slot off the free list.  Returns false if it's empty.
+  bool pop_free(uint32_t &slot_idx);
+
+  // Put a slot on the free list and wake anyone waiting for one.
+  void push_free(uint32_t slot_idx);
+
+  // See get_buffer_size() and get_buffer_count().
+  size_t buffer_size;
+  uint32_t slot_count;
+
+  // The memory of each slot, or null if we haven't mapped it yet.  Only
+  // the thread holding a slot touches its entry.
+  std::unique_ptr<char *[]> slot_datas;
+
+  // The free list, as a stack threaded through the slots.  The head packs
+  // a count of changes into the top 32 bits, so a slot which is popped and
+  // pushed back between another thread's read and its compare-and-swap
+  // doesn't fool it, and one more than the index of the top slot into the
+  // bottom 32 bits, with zero meaning the list is empty.  Each slot's entry
+  // in next_free is, likewise, one more than the index of the slot under
+  // it.
+  std::atomic<uint64_t> free_head;
+  std::unique_ptr<std::atomic<uint32_t>[]> next_free;
+
+  // How many threads are waiting for a slot.  Handing a slot back only
+  // bothers with the mutex when this isn't zero.
+  std::atomic<size_t> waiter_count;
+
+  // Cover waiting for a slot to be handed back.
+  std::mutex mutex;
+  std::condition_variable freed;
+
+};  // buffer_pool_t
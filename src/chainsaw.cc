@@ -19,12 +19,8 @@
 #include <sys/stat.h>     // fstat()
 
 // Chainsaw headers
-#include "crc.h"
-#include "file.h"
 #include "help.h"
-#include "join.h"
-#include "shard_hdr.h"
-#include "split.h"
+#include "libchainsaw.h"
 
 // A class representing the application itself.  We never make more than one
 // of these, but it's a convenient way to express the startup-run-teardown
@@ -54,6 +50,11 @@ public:
     max_shard_size = 0;
     make_directory = false;
     shard_prefix = "shard";
+    stripe = stripe_t::round_robin;
+    checksum_algo = checksum_algo_t::crc32;
+    is_consuming = false;
+    is_consuming_source = false;
+    is_aligned = false;
 
     // Arg parse
     try {
@@ -69,9 +70,62 @@ public:
           continue;
         }
 
+        // Check for a limit on how much we leave for the kernel to write
+        // back at once.  Zero leaves it all to the kernel.
+        if (app_params[i] == "-b") {
+          writeback.dirty_limit =
+              static_cast<uint64_t>(atoi(app_params.at(++i).c_str()));
+          writeback.dirty_limit *= 1024 * 1024; // Convert to MB
+          continue;
+        }
+
+        // Check for a limit on the memory we copy through, across all
+        // threads
+        if (app_params[i] == "-m") {
+          uint64_t budget =
+              static_cast<uint64_t>(atoi(app_params.at(++i).c_str()));
+          if (budget < 1) {
+            throw std::runtime_error { "Buffers need at least 1MB to work with." };
+          }
+          buffer_pool_t::configure_default(
+              buffer_pool_t::default_buffer_size, budget * 1024 * 1024);
+          continue;
+        }
+
+        // Check for the flag to consume the shards while joining
+        if (app_params[i] == "--consume") { is_consuming = true; continue; }
+
+        // Check for the flag to consume the file while splitting
+        if (app_params[i] == "--consume-source") {
+          is_consuming_source = true;
+          continue;
+        }
+
+        // Check for the durability flag
+        if (app_params[i] == "-f") { writeback.is_durable = true; continue; }
+
+        // Check for a checksum algorithm
+        if (app_params[i] == "-c") {
+          checksum_algo = parse_checksum_algo(app_params.at(++i));
+          continue;
+        }
+
+        // Check for the flag to align shard data to file system blocks
+        if (app_params[i] == "-a") { is_aligned = true; continue; }
+
         // Check for the directory flag
         if (app_params[i] == "-d") { make_directory = true; continue; }
 
+        // Check for an output directory.  Giving more than one spreads the
+        // shards across them.
+        if (app_params[i] == "-o") {
+          out_dirs.emplace_back(app_params.at(++i));
+          continue;
+        }
+
+        // Check for the weighted striping flag
+        if (app_params[i] == "-w") { stripe = stripe_t::weighted; continue; }
+
         // Check for a shard prefix
         if (app_params[i] == "-n") {
           shard_prefix = app_params[++i];
@@ -110,7 +164,9 @@ public:
 
     // Verbose supplied params
     std::cout << "Supplied Parameters: { size => " << max_shard_size << ", mkdir => "
-      << make_directory << ", prefix => '" << shard_prefix << "' }" << std::endl;
+      << make_directory << ", prefix => '" << shard_prefix << "', outdirs => "
+      << out_dirs.size() << ", checksum => " << get_name(checksum_algo) << " }"
+      << std::endl;
 
     // Verbose user files
     std::cout << "The following were 'files': {" << std::endl;
@@ -121,18 +177,49 @@ public:
     }
     std::cout << "}" << std::endl;
 
-    if (user_files.size() == 1) {
+    if (user_files.size() == 1 && is_dir_or_glob(user_files[0])) {
+      // We have a directory or a pattern, so join the shards we find there.
+      result = is_consuming
+          ? join_consume_found(user_files[0], writeback)
+          : join_found(user_files[0], writeback);
+    } else if (user_files.size() == 1 && !is_consuming) {
       // We have exactly one argument so split it.
-      result = split(app_params[0], max_shard_size);
+      if (is_consuming_source) {
+        if (!out_dirs.empty()) {
+          throw std::runtime_error {
+              "Shards go next to the file when consuming it, so -o can't be"
+              " used." };
+        }
+        result = split_consume(
+            user_files[0], max_shard_size, checksum_algo, writeback,
+            is_aligned);
+      } else {
+        result = split(
+            user_files[0], max_shard_size, out_dirs, stripe, checksum_algo,
+            writeback, is_aligned);
+      }
     } else {
-      // We have exactly some other number of arguments, so join them.
-      result = join(app_params);
+      // We have exactly some other number of arguments, or the last shard
+      // left from consuming the rest, so join them.
+      result = is_consuming
+          ? join_consume(user_files, writeback)
+          : join(user_files, writeback);
     }
     return result;
   }
 
 private:
 
+  // True if the path names a directory, or names nothing at all but looks
+  // like a glob pattern.
+  static bool is_dir_or_glob(const std::string &path) {
+    struct stat stat;
+    if (::stat(path.c_str(), &stat) == 0) {
+      return S_ISDIR(stat.st_mode);
+    }
+    return path.find_first_of("*?[") != std::string::npos;
+  }
+
   // App name and params
   std::string app_name;
   std::vector<std::string> app_params;
@@ -147,6 +234,13 @@ private:
   std::string shard_prefix;
   bool make_directory;
   uint64_t max_shard_size;
+  std::vector<std::string> out_dirs;
+  stripe_t stripe;
+  checksum_algo_t checksum_algo;
+  writeback_t writeback;
+  bool is_consuming;
+  bool is_consuming_source;
+  bool is_aligned;
 };  // app_t
 
 // A helper function for printing an exception to the standard error pipe.
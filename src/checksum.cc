@@ -0,0 +1,240 @@
+#include "checksum.h"
+
+#include <algorithm>      // std::min
+#include <cstring>        // memcpy
+#include <iomanip>        // std::quoted
+#include <stdexcept>      // std::runtime_error
+#include <sstream>        // std::ostringstream
+
+#include "crc.h"
+
+// The XXH64 primes.
+static const uint64_t prime1 = 11400714785074694791ULL;
+static const uint64_t prime2 = 14029467366897019727ULL;
+static const uint64_t prime3 =  1609587929392839161ULL;
+static const uint64_t prime4 =  9650029242287828579ULL;
+static const uint64_t prime5 =  2870177450012600261ULL;
+
+static uint64_t rotl(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const uint8_t *bytes) {
+  uint64_t result;
+  memcpy(&result, bytes, sizeof(result));
+  return result;
+}
+
+static uint32_t read32(const uint8_t *bytes) {
+  uint32_t result;
+  memcpy(&result, bytes, sizeof(result));
+  return result;
+}
+
+// Mix eight bytes of input into an XXH64 accumulator.
+static uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+  acc += input * prime2;
+  acc = rotl(acc, 31);
+  return acc * prime1;
+}
+
+// Fold an accumulator into the hash at the end.
+static uint64_t xxh64_merge(uint64_t hash, uint64_t acc) {
+  hash ^= xxh64_round(0, acc);
+  return hash * prime1 + prime4;
+}
+
+const char *get_name(checksum_algo_t algo) {
+  switch (algo) {
+    case checksum_algo_t::crc32: {
+      return "crc32";
+    }
+    case checksum_algo_t::crc32c: {
+      return "crc32c";
+    }
+    case checksum_algo_t::xxh64: {
+      return "xxh64";
+    }
+  }  // switch
+  return "unknown";
+}
+
+checksum_algo_t parse_checksum_algo(const std::string &name) {
+  for (auto algo: {
+      checksum_algo_t::crc32, checksum_algo_t::crc32c,
+      checksum_algo_t::xxh64 }) {
+    if (name == get_name(algo)) {
+      return algo;
+    }
+  }  // for
+  std::ostringstream msg;
+  msg << "There's no checksum algorithm called " << std::quoted(name) << '.';
+  throw std::runtime_error { msg.str() };
+}
+
+bool is_valid(checksum_algo_t algo) {
+  return algo == checksum_algo_t::crc32 || algo == checksum_algo_t::crc32c ||
+      algo == checksum_algo_t::xxh64;
+}
+
+// Start out with the checksum of nothing.
+checksum_t::checksum_t(checksum_algo_t algo)
+    : algo(algo), crc(0), tail_size(0), total_size(0) {
+  accs[0] = prime1 + prime2;
+  accs[1] = prime2;
+  accs[2] = 0;
+  accs[3] = -prime1;
+}
+
+// Add bytes to the end of the stream.
+void checksum_t::update(const void *buffer, size_t size) {
+  switch (algo) {
+    case checksum_algo_t::crc32: {
+      update_crc(crc, buffer, size);
+      return;
+    }
+    case checksum_algo_t::crc32c: {
+      update_crc32c(crc, buffer, size);
+      return;
+    }
+    case checksum_algo_t::xxh64: {
+      break;
+    }
+  }  // switch
+  auto bytes = static_cast<const uint8_t *>(buffer);
+  total_size += size;
+  // Top off the tail, if we have one, and, if that makes a whole stripe,
+  // mix it in.
+  if (tail_size) {
+    size_t fill_size = std::min(size, sizeof(tail) - tail_size);
+    memcpy(tail + tail_size, bytes, fill_size);
+    tail_size += fill_size;
+    bytes += fill_size;
+    size  -= fill_size;
+    if (tail_size < sizeof(tail)) {
+      return;
+    }
+    for (int i = 0; i < 4; ++i) {
+      accs[i] = xxh64_round(accs[i], read64(tail + i * 8));
+    }  // for
+    tail_size = 0;
+  }
+  // Mix in whole stripes straight from the buffer.
+  uint64_t acc0 = accs[0], acc1 = accs[1], acc2 = accs[2], acc3 = accs[3];
+  while (size >= sizeof(tail)) {
+    acc0 = xxh64_round(acc0, read64(bytes));
+    acc1 = xxh64_round(acc1, read64(bytes + 8));
+    acc2 = xxh64_round(acc2, read64(bytes + 16));
+    acc3 = xxh64_round(acc3, read64(bytes + 24));
+    bytes += sizeof(tail);
+    size  -= sizeof(tail);
+  }  // while
+  accs[0] = acc0;
+  accs[1] = acc1;
+  accs[2] = acc2;
+  accs[3] = acc3;
+  // Keep what's left for next time.
+  memcpy(tail, bytes, size);
+  tail_size = size;
+}
+
+// Add size zero bytes to the end of the stream.
+void checksum_t::update_zeros(uint64_t size) {
+  switch (algo) {
+    case checksum_algo_t::crc32: {
+      update_crc_zeros(crc, size);
+      return;
+    }
+    case checksum_algo_t::crc32c: {
+      update_crc32c_zeros(crc, size);
+      return;
+    }
+    case checksum_algo_t::xxh64: {
+      break;
+    }
+  }  // switch
+  // There's no shortcut for a hash, so we feed it the zeros.
+  static const char zeros[0x10000] = { 0 };
+  while (size) {
+    auto piece_size =
+        static_cast<size_t>(std::min<uint64_t>(sizeof(zeros), size));
+    update(zeros, piece_size);
+    size -= piece_size;
+  }  // while
+}
+
+// The checksum of the stream so far.
+uint64_t checksum_t::get() const {
+  if (algo != checksum_algo_t::xxh64) {
+    return crc;
+  }
+  // Merge the accumulators, if we've filled any stripes.
+  uint64_t hash;
+  if (total_size >= sizeof(tail)) {
+    hash =
+        rotl(accs[0], 1) + rotl(accs[1], 7) + rotl(accs[2], 12) +
+        rotl(accs[3], 18);
+    for (int i = 0; i < 4; ++i) {
+      hash = xxh64_merge(hash, accs[i]);
+    }  // for
+  } else {
+    hash = accs[2] + prime5;
+  }
+  hash += total_size;
+  // Mix in the tail.
+  const uint8_t *bytes = tail;
+  size_t size = tail_size;
+  while (size >= 8) {
+    hash ^= xxh64_round(0, read64(bytes));
+    hash = rotl(hash, 27) * prime1 + prime4;
+    bytes += 8;
+    size  -= 8;
+  }  // while
+  if (size >= 4) {
+    hash ^= read32(bytes) * prime1;
+    hash = rotl(hash, 23) * prime2 + prime3;
+    bytes += 4;
+    size  -= 4;
+  }
+  while (size) {
+    hash ^= *bytes * prime5;
+    hash = rotl(hash, 11) * prime1;
+    ++bytes;
+    --size;
+  }  // while
+  // Avalanche.
+  hash ^= hash >> 33;
+  hash *= prime2;
+  hash ^= hash >> 29;
+  hash *= prime3;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+// Given the checksums of two blocks, and the size of the second one,
+// return a checksum of the two, back to back.
+uint64_t checksum_t::combine(
+    checksum_algo_t algo, uint64_t sum1, uint64_t sum2, uint64_t size2) {
+  switch (algo) {
+    case checksum_algo_t::crc32: {
+      return combine_crc(
+          static_cast<uint32_t>(sum1), static_cast<uint32_t>(sum2), size2);
+    }
+    case checksum_algo_t::crc32c: {
+      return combine_crc32c(
+          static_cast<uint32_t>(sum1), static_cast<uint32_t>(sum2), size2);
+    }
+    case checksum_algo_t::xxh64: {
+      break;
+    }
+  }  // switch
+  // Hash the two hashes and the size.  Starting a fold from zero, the first
+  // step just gives back the first hash.
+  if (!sum1) {
+    return sum2;
+  }
+  const uint64_t words[] = { sum1, sum2, size2 };
+  checksum_t checksum { checksum_algo_t::xxh64 };
+  checksum.update(words, sizeof(words));
+  return checksum.get();
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstddef>        // size_t
+#include <cstdint>        // uint64_t
+#include <string>         // std::string
+
+// The checksum algorithms a shard may use.  The values are recorded in shard
+// headers, so don't change them.
+enum class checksum_algo_t : uint32_t {
+
+  // Plain CRC-32, computed in software.  This is what every shard used
+  // before shards recorded an algorithm, so it's the default.
+  crc32 = 0,
+
+  // CRC-32C, computed in hardware where the processor supports it.
+  crc32c = 1,
+
+  // XXH64, a fast, 64-bit, non-cryptographic hash, much less likely than a
+  // 32-bit CRC to miss damage to a very large file.  It has to hash every
+  // zero in a hole, though, so, for a file which is mostly holes, either CRC
+  // is far faster.
+  xxh64 = 2
+
+};  // checksum_algo_t
+
+// The name of an algorithm, as the user would give it.
+const char *get_name(checksum_algo_t algo);
+
+// The algorithm with the given name.  Throws if there isn't one.
+checksum_algo_t parse_checksum_algo(const std::string &name);
+
+// True if the value is an algorithm we know.
+bool is_valid(checksum_algo_t algo);
+
+// A running checksum of a stream of bytes, using any of the algorithms.
+class checksum_t final {
+public:
+
+  // Start out with the checksum of nothing.
+  explicit checksum_t(checksum_algo_t algo = checksum_algo_t::crc32);
+
+  // Add bytes to the end of the stream.
+  void update(const void *buffer, size_t size);
+
+  // Add size zero bytes to the end of the stream.  The CRCs do this in time
+  // proportional to the log of size; XXH64 takes time proportional to size.
+  void update_zeros(uint64_t size);
+
+  // The checksum of the stream so far.
+  uint64_t get() const;
+
+  // Given the checksums of two blocks, and the size of the second one,
+  // return a checksum of the two, back to back.  Folding the checksums of
+  // the pieces of a file together this way, in order, starting from zero,
+  // gives a checksum of the whole file, so each piece may be checksummed by
+  // a different thread.  For the CRCs, the result is exactly the CRC of the
+  // whole file.  For XXH64, which can't be combined that way, the result is
+  // a hash of the pieces' hashes and sizes.
+  static uint64_t combine(
+      checksum_algo_t algo, uint64_t sum1, uint64_t sum2, uint64_t size2);
+
+private:
+
+  // The algorithm we use.
+  checksum_algo_t algo;
+
+  // The CRC so far, for the CRCs.
+  uint32_t crc;
+
+  // The XXH64 state: the four accumulators, the bytes which don't yet make
+  // up a full 32-byte stripe, and the total size so far.
+  uint64_t accs[4];
+  uint8_t tail[32];
+  size_t tail_size;
+  uint64_t total_size;
+
+};  // checksum_t
@@ -1,5 +1,11 @@
 #include "crc.h"
 
+#include <cstring> // memcpy
+
+#if defined(__x86_64__)
+#include <nmmintrin.h> // _mm_crc32_u64
+#endif
+
 void update_crc(uint32_t &crc, const void *buffer, size_t size) {
 
   // The CRC polynomial table.
@@ -58,3 +64,162 @@ void update_crc(uint32_t &crc, const void *buffer, size_t size) {
   }  // for
   crc ^= 0xFFFFFFFF;
 }
+
+// Multiply a vector by a 32x32 matrix over GF(2).  Each element of mat is a
+// column, and vec picks which columns get summed.
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec) {
+  uint32_t sum = 0;
+  while (vec) {
+    if (vec & 1) {
+      sum ^= *mat;
+    }
+    vec >>= 1;
+    ++mat;
+  }  // while
+  return sum;
+}
+
+// Square a 32x32 matrix over GF(2).
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat) {
+  for (int n = 0; n < 32; ++n) {
+    square[n] = gf2_matrix_times(mat, mat[n]);
+  }  // for
+}
+
+// Return the raw CRC register, reg, as it would be after feeding size zero
+// bytes through it.  The polynomial is given in reversed bit order.
+static uint32_t shift_crc(uint32_t poly, uint32_t reg, uint64_t size) {
+  if (!size) {
+    return reg;
+  }
+  // This is the same trick zlib uses in crc32_combine().  Feeding a zero
+  // byte to the CRC register is a linear operation, so we can express it as
+  // a matrix, and feeding in n zero bytes is that matrix raised to the nth
+  // power, which we get by repeated squaring.  We start with the operator
+  // for a single zero bit.
+  uint32_t odd[32], even[32];
+  odd[0] = poly;
+  uint32_t row = 1;
+  for (int n = 1; n < 32; ++n) {
+    odd[n] = row;
+    row <<= 1;
+  }  // for
+  // Square it twice, giving the operators for two and then four zero bits.
+  gf2_matrix_square(even, odd);
+  gf2_matrix_square(odd, even);
+  // Work through the bits of size, squaring the operator each time (the
+  // first squaring gives us the operator for a whole zero byte) and applying
+  // it wherever size has a one bit.
+  for (;;) {
+    gf2_matrix_square(even, odd);
+    if (size & 1) {
+      reg = gf2_matrix_times(even, reg);
+    }
+    size >>= 1;
+    if (!size) {
+      break;
+    }
+    gf2_matrix_square(odd, even);
+    if (size & 1) {
+      reg = gf2_matrix_times(odd, reg);
+    }
+    size >>= 1;
+    if (!size) {
+      break;
+    }
+  }  // for
+  return reg;
+}
+
+// The CRC-32 polynomial, in reversed bit order.
+static const uint32_t crc32_poly = 0xEDB88320;
+
+void update_crc_zeros(uint32_t &crc, uint64_t size) {
+  // The register is kept inverted, just as update_crc() does.
+  crc = shift_crc(crc32_poly, crc ^ 0xFFFFFFFF, size) ^ 0xFFFFFFFF;
+}
+
+uint32_t combine_crc(uint32_t crc1, uint32_t crc2, uint64_t size2) {
+  // The inversions at either end of the second block cancel out, so this
+  // is just the first CRC shifted past the second block, plus the second.
+  return shift_crc(crc32_poly, crc1, size2) ^ crc2;
+}
+
+// The CRC-32C (Castagnoli) polynomial, in reversed bit order.
+static const uint32_t crc32c_poly = 0x82F63B78;
+
+// Update a raw CRC-32C register a byte at a time, using a table.
+static uint32_t update_crc32c_sw(
+    uint32_t reg, const uint8_t *bytes, size_t size) {
+  // Build the table the first time through.
+  static const struct table_t final {
+    uint32_t entries[256];
+    table_t() {
+      for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t entry = i;
+        for (int bit = 0; bit < 8; ++bit) {
+          entry = (entry & 1) ? (entry >> 1) ^ crc32c_poly : entry >> 1;
+        }  // for
+        entries[i] = entry;
+      }  // for
+    }
+  } table;
+  for (size_t i = 0; i < size; ++i) {
+    reg = table.entries[(reg ^ bytes[i]) & 0xFF] ^ (reg >> 8);
+  }  // for
+  return reg;
+}
+
+#if defined(__x86_64__)
+
+// Update a raw CRC-32C register using the SSE 4.2 crc32 instruction, eight
+// bytes at a time.
+__attribute__((target("sse4.2")))
+static uint32_t update_crc32c_hw(
+    uint32_t reg, const uint8_t *bytes, size_t size) {
+  // Get to an eight-byte boundary, then do the bulk of it, then the tail.
+  while (size && (reinterpret_cast<uintptr_t>(bytes) & 7)) {
+    reg = _mm_crc32_u8(reg, *bytes++);
+    --size;
+  }  // while
+  uint64_t reg64 = reg;
+  while (size >= 8) {
+    uint64_t word;
+    memcpy(&word, bytes, 8);
+    reg64 = _mm_crc32_u64(reg64, word);
+    bytes += 8;
+    size  -= 8;
+  }  // while
+  reg = static_cast<uint32_t>(reg64);
+  while (size) {
+    reg = _mm_crc32_u8(reg, *bytes++);
+    --size;
+  }  // while
+  return reg;
+}
+
+#endif
+
+void update_crc32c(uint32_t &crc, const void *buffer, size_t size) {
+  auto bytes = static_cast<const uint8_t *>(buffer);
+  uint32_t reg = crc ^ 0xFFFFFFFF;
+#if defined(__x86_64__)
+  static const bool has_sse42 = __builtin_cpu_supports("sse4.2");
+  if (has_sse42) {
+    reg = update_crc32c_hw(reg, bytes, size);
+  } else {
+    reg = update_crc32c_sw(reg, bytes, size);
+  }
+#else
+  reg = update_crc32c_sw(reg, bytes, size);
+#endif
+  crc = reg ^ 0xFFFFFFFF;
+}
+
+void update_crc32c_zeros(uint32_t &crc, uint64_t size) {
+  crc = shift_crc(crc32c_poly, crc ^ 0xFFFFFFFF, size) ^ 0xFFFFFFFF;
+}
+
+uint32_t combine_crc32c(uint32_t crc1, uint32_t crc2, uint64_t size2) {
+  return shift_crc(crc32c_poly, crc1, size2) ^ crc2;
+}
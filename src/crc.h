@@ -3,4 +3,21 @@
 #include <cstdint> // uint32_t
 #include <cstddef> // size_t
 
-void update_crc(uint32_t &crc, const void *buffer, size_t size);
\ No newline at end of file
+void update_crc(uint32_t &crc, const void *buffer, size_t size);
+
+// Update the CRC as though size zero bytes had been passed to update_crc(),
+// but without touching them.  This takes time proportional to the log of
+// size, so it's how we account for the holes in a sparse file.
+void update_crc_zeros(uint32_t &crc, uint64_t size);
+
+// Given the CRCs of two blocks of bytes and the size of the second one,
+// return the CRC of the two blocks back to back.  This lets us compute the
+// CRCs of pieces of a file separately and put them together after.
+uint32_t combine_crc(uint32_t crc1, uint32_t crc2, uint64_t size2);
+
+// The same as the above, but for CRC-32C (Castagnoli), which is better at
+// catching errors in large blocks and which x86 processors with SSE 4.2 can
+// compute in hardware.  We use the instruction if we have it.
+void update_crc32c(uint32_t &crc, const void *buffer, size_t size);
+void update_crc32c_zeros(uint32_t &crc, uint64_t size);
+uint32_t combine_crc32c(uint32_t crc1, uint32_t crc2, uint64_t size2);
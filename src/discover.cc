@@ -0,0 +1,170 @@
+#include "discover.h"
+
+#include <cctype>         // isdigit
+#include <cerrno>         // errno
+#include <cstring>        // strrchr
+#include <iomanip>        // std::quoted
+#include <stdexcept>      // std::runtime_error
+#include <sstream>        // std::ostringstream
+#include <system_error>   // std::system_category
+#include <utility>        // std::move
+
+#include <dirent.h>       // opendir()
+#include <glob.h>         // glob()
+#include <sys/resource.h> // setrlimit()
+#include <sys/stat.h>     // stat()
+
+#include "workers.h"
+
+// The most threads we'll use to open files at once.  Opening a file is
+// mostly waiting on storage, so this can be well above the number of cores.
+static const size_t max_open_thread_count = 32;
+
+// The number of file descriptors we leave for everything besides the
+// shards, such as the output and the standard pipes.
+static const rlim_t spare_fd_count = 64;
+
+// True if the name looks like "foo@2.3".
+static bool is_shard_name(const char *name) {
+  const char *at = strrchr(name, '@');
+  if (!at || at == name) {
+    return false;
+  }
+  const char *cursor = at + 1;
+  if (!isdigit(*cursor)) {
+    return false;
+  }
+  while (isdigit(*cursor)) {
+    ++cursor;
+  }  // while
+  if (*cursor++ != '.' || !isdigit(*cursor)) {
+    return false;
+  }
+  while (isdigit(*cursor)) {
+    ++cursor;
+  }  // while
+  return *cursor == '\0';
+}
+
+// List the shards in a directory.
+static std::vector<std::string> list_dir(const std::string &dir_name) {
+  DIR *dir = opendir(dir_name.c_str());
+  if (!dir) {
+    throw std::system_error { errno, std::system_category() };
+  }
+  std::vector<std::string> paths;
+  for (;;) {
+    errno = 0;
+    const dirent *entry = readdir(dir);
+    if (!entry) {
+      break;
+    }
+    if (is_shard_name(entry->d_name)) {
+      paths.emplace_back(dir_name + '/' + entry->d_name);
+    }
+  }  // for
+  int error = errno;
+  closedir(dir);
+  if (error) {
+    throw std::system_error { error, std::system_category() };
+  }
+  return paths;
+}
+
+// List the files matching a glob pattern.
+static std::vector<std::string> list_glob(const std::string &pattern) {
+  glob_t matches;
+  int result = glob(pattern.c_str(), GLOB_NOSORT, nullptr, &matches);
+  if (result == GLOB_NOMATCH) {
+    return {};
+  }
+  if (result != 0) {
+    globfree(&matches);
+    throw std::runtime_error { "The pattern could not be expanded." };
+  }
+  std::vector<std::string> paths(
+      matches.gl_pathv, matches.gl_pathv + matches.gl_pathc);
+  globfree(&matches);
+  return paths;
+}
+
+std::vector<std::string> find_shards(const std::string &dir_or_glob) {
+  std::vector<std::string> paths;
+  try {
+    struct stat stat;
+    if (::stat(dir_or_glob.c_str(), &stat) == 0 && S_ISDIR(stat.st_mode)) {
+      paths = list_dir(dir_or_glob);
+    } else {
+      paths = list_glob(dir_or_glob);
+    }
+    if (paths.empty()) {
+      throw std::runtime_error { "There are no shards there." };
+    }
+  } catch (...) {
+    std::ostringstream msg;
+    msg << "Could not find shards in " << std::quoted(dir_or_glob) << '.';
+    std::throw_with_nested(std::runtime_error { msg.str() });
+  }
+  return paths;
+}
+
+std::vector<std::string> find_shards_of(const std::string &path) {
+  std::vector<std::string> paths;
+  try {
+    auto slash = path.rfind('/');
+    std::string dir_name =
+        slash == std::string::npos ? "." :
+        slash == 0 ? "/" : path.substr(0, slash);
+    std::string base_name =
+        slash == std::string::npos ? path : path.substr(slash + 1);
+    for (auto &shard_path: list_dir(dir_name)) {
+      auto at = shard_path.rfind('@');
+      auto shard_slash = shard_path.rfind('/');
+      if (shard_path.compare(
+              shard_slash + 1, at - shard_slash - 1, base_name) == 0) {
+        paths.push_back(std::move(shard_path));
+      }
+    }  // for
+  } catch (...) {
+    std::ostringstream msg;
+    msg << "Could not look for the shards of " << std::quoted(path) << '.';
+    std::throw_with_nested(std::runtime_error { msg.str() });
+  }
+  return paths;
+}
+
+// Make sure we can have at least count files open at once, plus some to
+// spare.
+static void reserve_fds(size_t count) {
+  rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) < 0) {
+    throw std::system_error { errno, std::system_category() };
+  }
+  rlim_t needed = static_cast<rlim_t>(count) + spare_fd_count;
+  if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < needed) {
+    if (limit.rlim_max != RLIM_INFINITY && limit.rlim_max < needed) {
+      std::ostringstream msg;
+      msg
+          << "Can't hold " << count << " shards open at once; "
+          << "raise the hard limit on open files to at least " << needed
+          << '.';
+      throw std::runtime_error { msg.str() };
+    }
+    limit.rlim_cur = needed;
+    if (setrlimit(RLIMIT_NOFILE, &limit) < 0) {
+      throw std::system_error { errno, std::system_category() };
+    }
+  }
+}
+
+std::vector<std::unique_ptr<source_t>> open_file_sources(
+    const std::vector<std::string> &paths) {
+  reserve_fds(paths.size());
+  std::vector<std::unique_ptr<source_t>> sources(paths.size());
+  run_parallel(
+      paths.size(), max_open_thread_count,
+      [&paths, &sources](size_t i) {
+        sources[i].reset(new file_source_t { paths[i] });
+      });
+  return sources;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <memory>         // std::unique_ptr
+#include <string>         // std::string
+#include <vector>         // std::vector
+
+#include "source.h"
+
+// Find the shards named by a directory, meaning every file in it named like
+// a shard ("foo@2.3"), or by a glob pattern, such as "/mnt/*/foo@*".  The
+// paths come back in no particular order.  Throws if there are none.
+std::vector<std::string> find_shards(const std::string &dir_or_glob);
+
+// Find the shards made from the file at the given path which sit next to
+// it, such as "foo@2.3" for "foo".  The paths come back in no particular
+// order.  Unlike find_shards(), finding none isn't an error.
+std::vector<std::string> find_shards_of(const std::string &path);
+
+// Open the files at the given paths as sources, using a pool of threads so
+// that the round trips to storage overlap.  The sources stay open until
+// they're destroyed, so, if need be, we raise the limit on the number of
+// files this process may have open.
+std::vector<std::unique_ptr<source_t>> open_file_sources(
+    const std::vector<std::string> &paths);
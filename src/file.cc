@@ -2,6 +2,7 @@
 #include "file.h"
 
 // Compiler-provided headers go first.
+#include <algorithm>      // std::min
 #include <cassert>        // assert
 #include <cstring>        // memset
 #include <iomanip>        // std::quoted
@@ -14,6 +15,9 @@
 #include <vector>         // std::vector
 
 // Operating system headers go second.
+#include <limits.h>       // IOV_MAX
+
+#include "buffer_pool.h"
 
 // The operating system calls this structure 'stat', but that name looks
 // like a value, so we'll rename it to use our types-end-in-t convention.
@@ -95,6 +99,16 @@ std::pair<uint64_t, mode_t> file_t::get_size_and_mode() const {
   return { static_cast<uint64_t>(stat.st_size), stat.st_mode };
 }
 
+// The size of the blocks the file system holding the file allocates in.
+uint64_t file_t::get_block_size() const {
+  assert(fd >= 0);
+  stat_t stat;
+  if (fstat(fd, &stat) < 0) {
+    throw std::system_error { errno, std::system_category() };
+  }
+  return static_cast<uint64_t>(stat.st_blksize);
+}
+
 // Read at most max_size bytes from the file and store them in buffer.
 // Return the actual number of bytes read.
 size_t file_t::read_at_most(char *buffer, size_t max_size) {
@@ -104,7 +118,10 @@ size_t file_t::read_at_most(char *buffer, size_t max_size) {
   // returns -1.  This means the return type, ssize_t, must be signed.
   // But we want to return a normal size_t (which is unsigned) so, after
   // checking for an error, we cast the result.
-  ssize_t result = read(fd, buffer, max_size);
+  ssize_t result;
+  do {
+    result = read(fd, buffer, max_size);
+  } while (result < 0 && errno == EINTR);
   if (result < 0) {
     throw std::system_error { errno, std::system_category() };
   }
@@ -117,6 +134,10 @@ void file_t::read_exactly(char *buffer, size_t size) {
   while (size) {
     ssize_t result = read(fd, buffer, size);
     if (result < 0) {
+      // If a signal interrupted us, just try again.
+      if (errno == EINTR) {
+        continue;
+      }
       throw std::system_error { errno, std::system_category() };
     }
     if (result == 0) {
@@ -128,6 +149,94 @@ void file_t::read_exactly(char *buffer, size_t size) {
   }
 }
 
+// Read at most max_size bytes from the file, starting at the given offset,
+// and store them in buffer.  Return the actual number of bytes read.  This
+// doesn't use or move our position in the file, so several threads can
+// read the same file at once.
+size_t file_t::read_at_most_at(
+    char *buffer, size_t max_size, uint64_t offset) {
+  assert(fd >= 0);
+  for (;;) {
+    ssize_t result =
+        pread64(fd, buffer, max_size, static_cast<off64_t>(offset));
+    if (result >= 0) {
+      return static_cast<size_t>(result);
+    }
+    // If a signal interrupted us, just try again.
+    if (errno != EINTR) {
+      throw std::system_error { errno, std::system_category() };
+    }
+  }  // for
+}
+
+// Read exactly size bytes from the file, starting at the given offset, to
+// the buffer.
+void file_t::read_exactly_at(char *buffer, size_t size, uint64_t offset) {
+  while (size) {
+    size_t read_size = read_at_most_at(buffer, size, offset);
+    if (!read_size) {
+      throw std::runtime_error { "Unexpected end of file." };
+    }
+    buffer += read_size;
+    size   -= read_size;
+    offset += read_size;
+  }  // while
+}
+
+// Skip past size bytes of the buffers in iov, which we've already
+// transferred, dropping the buffers we've finished with and trimming the
+// front of the one we're part way through.
+static void advance_vector(
+    std::vector<iovec> &iov, size_t &first, size_t size) {
+  while (size && first < iov.size()) {
+    size_t skip_size = std::min(size, iov[first].iov_len);
+    iov[first].iov_base = static_cast<char *>(iov[first].iov_base) + skip_size;
+    iov[first].iov_len -= skip_size;
+    size -= skip_size;
+    if (!iov[first].iov_len) {
+      ++first;
+    }
+  }  // while
+  // Skip over any empty buffers, too.
+  while (first < iov.size() && !iov[first].iov_len) {
+    ++first;
+  }  // while
+}
+
+// Read from the file, starting at the given offset, into each of the
+// buffers in turn.  Return the actual number of bytes read.
+size_t file_t::read_vector_at(
+    const iovec *iov, int iov_count, uint64_t offset) {
+  assert(fd >= 0);
+  // The kernel may read less than we ask for, so we keep a copy of the
+  // vector we can trim as we go.
+  std::vector<iovec> left(iov, iov + iov_count);
+  size_t first = 0;
+  advance_vector(left, first, 0);
+  size_t total_size = 0;
+  while (first < left.size()) {
+    ssize_t result = preadv64(
+        fd, left.data() + first,
+        static_cast<int>(std::min<size_t>(left.size() - first, IOV_MAX)),
+        static_cast<off64_t>(offset));
+    if (result < 0) {
+      // If a signal interrupted us, just try again.
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::system_error { errno, std::system_category() };
+    }
+    if (result == 0) {
+      break;
+    }
+    auto read_size = static_cast<size_t>(result);
+    advance_vector(left, first, read_size);
+    offset     += read_size;
+    total_size += read_size;
+  }  // while
+  return total_size;
+}
+
 // Seek to a new position within the file.  The offset is relative to either
 // the start of the file (whence=SEEK_SET), our current position within the
 // file (whence=SEEK_CUR), or from the end of the file (whence=SEEK_END).
@@ -142,6 +251,63 @@ uint64_t file_t::seek(int64_t offset, int whence) {
   return static_cast<uint64_t>(result);
 }
 
+// Find the start of the first region of data at or after the given
+// offset, skipping over any holes in a sparse file.  Returns the size of
+// the file if there's no data left.  On a file system which doesn't track
+// holes, this just returns offset.  This moves our position in the file.
+uint64_t file_t::find_data(uint64_t offset) {
+  assert(fd >= 0);
+  auto result = lseek64(fd, static_cast<off64_t>(offset), SEEK_DATA);
+  if (result < 0) {
+    switch (errno) {
+      // There's no data at or after offset, so we're at the end.
+      case ENXIO: {
+        return get_size_and_mode().first;
+      }
+      // The file system doesn't know about holes, so everything is data.
+      case EINVAL: {
+        return offset;
+      }
+      default: {
+        throw std::system_error { errno, std::system_category() };
+      }
+    }  // switch
+  }
+  return static_cast<uint64_t>(result);
+}
+
+// Find the start of the first hole at or after the given offset.  There's
+// an implicit hole at the end of every file, so this returns the size of
+// the file if there's no hole before that.  This moves our position in
+// the file.
+uint64_t file_t::find_hole(uint64_t offset) {
+  assert(fd >= 0);
+  auto result = lseek64(fd, static_cast<off64_t>(offset), SEEK_HOLE);
+  if (result < 0) {
+    switch (errno) {
+      // Either we were already past the end or the file system doesn't know
+      // about holes.  Either way, the only hole is the one at the end.
+      case ENXIO:
+      case EINVAL: {
+        return get_size_and_mode().first;
+      }
+      default: {
+        throw std::system_error { errno, std::system_category() };
+      }
+    }  // switch
+  }
+  return static_cast<uint64_t>(result);
+}
+
+// Set the size of the file, either cutting off its tail or extending it
+// with a hole.
+void file_t::truncate(uint64_t size) {
+  assert(fd >= 0);
+  if (ftruncate64(fd, static_cast<off64_t>(size)) < 0) {
+    throw std::system_error { errno, std::system_category() };
+  }
+}
+
 // Write exactly size bytes from buffer to the file.
 void file_t::write_exactly(const char *buffer, size_t size) {
   assert(fd >= 0);
@@ -153,6 +319,10 @@ void file_t::write_exactly(const char *buffer, size_t size) {
     // the sign.
     ssize_t result = write(fd, buffer, size);
     if (result < 0) {
+      // If a signal interrupted us, just try again.
+      if (errno == EINTR) {
+        continue;
+      }
       throw std::system_error { errno, std::system_category() };
     }
     auto write_size = static_cast<size_t>(result);
@@ -163,6 +333,196 @@ void file_t::write_exactly(const char *buffer, size_t size) {
   }
 }
 
+// Write exactly size bytes from buffer to the file, starting at the given
+// offset.
+void file_t::write_exactly_at(
+    const char *buffer, size_t size, uint64_t offset) {
+  assert(fd >= 0);
+  while (size) {
+    ssize_t result =
+        pwrite64(fd, buffer, size, static_cast<off64_t>(offset));
+    if (result < 0) {
+      // If a signal interrupted us, just try again.
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::system_error { errno, std::system_category() };
+    }
+    auto write_size = static_cast<size_t>(result);
+    buffer += write_size;
+    size   -= write_size;
+    offset += write_size;
+  }  // while
+}
+
+// Write all of each of the buffers in iov, in turn, to the file, starting at
+// the given offset.
+void file_t::write_vector_at(
+    const iovec *iov, int iov_count, uint64_t offset) {
+  assert(fd >= 0);
+  // The kernel may write less than we ask for, so we keep a copy of the
+  // vector we can trim as we go.
+  std::vector<iovec> left(iov, iov + iov_count);
+  size_t first = 0;
+  advance_vector(left, first, 0);
+  while (first < left.size()) {
+    ssize_t result = pwritev64(
+        fd, left.data() + first,
+        static_cast<int>(std::min<size_t>(left.size() - first, IOV_MAX)),
+        static_cast<off64_t>(offset));
+    if (result < 0) {
+      // If a signal interrupted us, just try again.
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::system_error { errno, std::system_category() };
+    }
+    auto write_size = static_cast<size_t>(result);
+    advance_vector(left, first, write_size);
+    offset += write_size;
+  }  // while
+}
+
+// Reserve storage for the first size bytes of the file, without changing
+// its size.  Returns false if the file system can't do this.
+bool file_t::allocate(uint64_t size) {
+  assert(fd >= 0);
+  if (!size) {
+    return true;
+  }
+  if (fallocate64(
+          fd, FALLOC_FL_KEEP_SIZE, 0, static_cast<off64_t>(size)) < 0) {
+    switch (errno) {
+      // The file system doesn't do preallocation.
+      case EOPNOTSUPP:
+      case ENOSYS: {
+        return false;
+      }
+      // Running out of space is just what we wanted to find out about.
+      default: {
+        throw std::system_error { errno, std::system_category() };
+      }
+    }  // switch
+  }
+  return true;
+}
+
+// Start writing the dirty pages in the given range of the file out to
+// storage, without waiting for them to get there.
+void file_t::start_writeback(uint64_t offset, uint64_t size) {
+  assert(fd >= 0);
+  if (sync_file_range(
+          fd, static_cast<off64_t>(offset), static_cast<off64_t>(size),
+          SYNC_FILE_RANGE_WRITE) < 0 &&
+      errno != ESPIPE && errno != ENOSYS) {
+    throw std::system_error { errno, std::system_category() };
+  }
+}
+
+// Wait for the dirty pages in the given range of the file to get to
+// storage, starting writeback on any which haven't yet.
+void file_t::finish_writeback(uint64_t offset, uint64_t size) {
+  assert(fd >= 0);
+  if (sync_file_range(
+          fd, static_cast<off64_t>(offset), static_cast<off64_t>(size),
+          SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+          SYNC_FILE_RANGE_WAIT_AFTER) < 0 &&
+      errno != ESPIPE && errno != ENOSYS) {
+    throw std::system_error { errno, std::system_category() };
+  }
+}
+
+// Wait for everything we've written to the file, and its metadata, to get
+// to storage.
+void file_t::sync() {
+  assert(fd >= 0);
+  if (fsync(fd) < 0) {
+    throw std::system_error { errno, std::system_category() };
+  }
+}
+
+// Cut the given range out of the file, without copying any data.  Returns
+// false if the file system can't do it.
+bool file_t::collapse_range(uint64_t offset, uint64_t size) {
+  assert(fd >= 0);
+  if (fallocate64(
+          fd, FALLOC_FL_COLLAPSE_RANGE, static_cast<off64_t>(offset),
+          static_cast<off64_t>(size)) < 0) {
+    switch (errno) {
+      // Either the file system doesn't do this at all, or it can't do it
+      // for a range which isn't a whole number of blocks.
+      case EOPNOTSUPP:
+      case ENOSYS:
+      case EINVAL: {
+        return false;
+      }
+      default: {
+        throw std::system_error { errno, std::system_category() };
+      }
+    }  // switch
+  }
+  return true;
+}
+
+// Copy size bytes from the given file to this one, having the kernel do it
+// if it can.
+void file_t::copy_from(
+    file_t &in, uint64_t in_offset, uint64_t out_offset, uint64_t size) {
+  assert(fd >= 0);
+  assert(in.fd >= 0);
+  while (size) {
+    auto in_off = static_cast<off64_t>(in_offset);
+    auto out_off = static_cast<off64_t>(out_offset);
+    ssize_t result = copy_file_range(
+        in.fd, &in_off, fd, &out_off,
+        static_cast<size_t>(std::min<uint64_t>(size, 0x40000000)), 0);
+    if (result < 0) {
+      switch (errno) {
+        // A signal interrupted us, so just try again.
+        case EINTR: {
+          continue;
+        }
+        // The kernel can't copy between these files, perhaps because
+        // they're on different file systems, so we do it ourselves.
+        case EXDEV:
+        case EINVAL:
+        case ENOSYS:
+        case EOPNOTSUPP: {
+          break;
+        }
+        default: {
+          throw std::system_error { errno, std::system_category() };
+        }
+      }  // switch
+      break;
+    }
+    if (result == 0) {
+      throw std::runtime_error { "Unexpected end of file." };
+    }
+    in_offset  += static_cast<uint64_t>(result);
+    out_offset += static_cast<uint64_t>(result);
+    size       -= static_cast<uint64_t>(result);
+  }  // while
+  // Copy whatever the kernel wouldn't through a buffer from the pool.
+  if (!size) {
+    return;
+  }
+  auto buffer = buffer_pool_t::get_default().acquire();
+  while (size) {
+    size_t read_size = in.read_at_most_at(
+        buffer.get_data(),
+        static_cast<size_t>(std::min<uint64_t>(buffer.get_size(), size)),
+        in_offset);
+    if (!read_size) {
+      throw std::runtime_error { "Unexpected end of file." };
+    }
+    write_exactly_at(buffer.get_data(), read_size, out_offset);
+    out_offset += read_size;
+    in_offset += read_size;
+    size      -= read_size;
+  }  // while
+}
+
 // Return a newly constructed file object with the file open for reading.
 // If the file doesn't exist, this throws.
 file_t file_t::open_ro(const std::string &path) {
@@ -213,4 +573,39 @@ file_t file_t::open_rw(const std::string &path, mode_t mode) {
     std::throw_with_nested(std::runtime_error { msg.str() });
   }
   return result;
-}
\ No newline at end of file
+}
+
+// Return a newly constructed file object with the existing file open for
+// reading and writing, leaving its contents alone.  If the file doesn't
+// exist, this throws.
+file_t file_t::open_rw_existing(const std::string &path) {
+  file_t result;
+  try {
+    result.fd = open(path.c_str(), O_RDWR);
+    if (result.fd < 0) {
+      throw std::system_error { errno, std::system_category() };
+    }
+  } catch (...) {
+    std::ostringstream msg;
+    msg << "Could not open " << std::quoted(path) << " for writing.";
+    std::throw_with_nested(std::runtime_error { msg.str() });
+  }
+  return result;
+}
+
+// Return a newly constructed file object with the given directory open,
+// so it can be synced.  If the directory doesn't exist, this throws.
+file_t file_t::open_dir(const std::string &path) {
+  file_t result;
+  try {
+    result.fd = open(path.c_str(), O_RDONLY | O_DIRECTORY);
+    if (result.fd < 0) {
+      throw std::system_error { errno, std::system_category() };
+    }
+  } catch (...) {
+    std::ostringstream msg;
+    msg << "Could not open the directory " << std::quoted(path) << '.';
+    std::throw_with_nested(std::runtime_error { msg.str() });
+  }
+  return result;
+}
@@ -4,6 +4,7 @@
 #include <utility>        // std::min
 
 #include <sys/stat.h>
+#include <sys/uio.h>      // iovec
 #include <fcntl.h>        // open()
 #include <unistd.h>       // close()
 
@@ -42,6 +43,9 @@ public:
   // simplify our lives if we just use uint64_t here.
   std::pair<uint64_t, mode_t> get_size_and_mode() const;
 
+  // The size of the blocks the file system holding the file allocates in.
+  uint64_t get_block_size() const;
+
   // Read at most max_size bytes from the file and store them in buffer.
   // Return the actual number of bytes read.
   size_t read_at_most(char *buffer, size_t max_size);
@@ -49,15 +53,91 @@ public:
   // Read exactly size bytes from the file to the buffer.
   void read_exactly(char *buffer, size_t size);
 
+  // Read at most max_size bytes from the file, starting at the given offset,
+  // and store them in buffer.  Return the actual number of bytes read.  This
+  // doesn't use or move our position in the file, so several threads can
+  // read the same file at once.  The same goes for all the other functions
+  // here which take an offset.
+  size_t read_at_most_at(char *buffer, size_t max_size, uint64_t offset);
+
+  // Read exactly size bytes from the file, starting at the given offset, to
+  // the buffer.
+  void read_exactly_at(char *buffer, size_t size, uint64_t offset);
+
+  // Read from the file, starting at the given offset, into each of the
+  // iov_count buffers in iov in turn, filling each before moving on to the
+  // next.  Return the actual number of bytes read, which is less than the
+  // buffers hold only if we reach the end of the file.
+  size_t read_vector_at(const iovec *iov, int iov_count, uint64_t offset);
+
   // Seek to a new position within the file.  The offset is relative to either
   // the start of the file (whence=SEEK_SET), our current position within the
   // file (whence=SEEK_CUR), or from the end of the file (whence=SEEK_END).
   // Returns the new position in the file as the number of bytes from the
   // start.
   uint64_t seek(int64_t offset, int whence);
+
+  // Find the start of the first region of data at or after the given
+  // offset, skipping over any holes in a sparse file.  Returns the size of
+  // the file if there's no data left.  On a file system which doesn't track
+  // holes, this just returns offset.  This moves our position in the file.
+  uint64_t find_data(uint64_t offset);
+
+  // Find the start of the first hole at or after the given offset.  There's
+  // an implicit hole at the end of every file, so this returns the size of
+  // the file if there's no hole before that.  This moves our position in
+  // the file.
+  uint64_t find_hole(uint64_t offset);
+
+  // Set the size of the file, either cutting off its tail or extending it
+  // with a hole.
+  void truncate(uint64_t size);
+
   // Write exactly size bytes from buffer to the file.
   void write_exactly(const char *buffer, size_t size);
 
+  // Write exactly size bytes from buffer to the file, starting at the given
+  // offset.  This can patch something we wrote earlier, such as a header,
+  // without disturbing our position.
+  void write_exactly_at(const char *buffer, size_t size, uint64_t offset);
+
+  // Write all of each of the iov_count buffers in iov, in turn, to the
+  // file, starting at the given offset, with as few system calls as
+  // possible.
+  void write_vector_at(const iovec *iov, int iov_count, uint64_t offset);
+
+  // Reserve storage for the first size bytes of the file, without changing
+  // its size, so the file system can lay it out in one piece and we find out
+  // now, rather than halfway through, if there isn't room.  Returns false if
+  // the file system can't do this, which is harmless.
+  bool allocate(uint64_t size);
+
+  // Start writing the dirty pages in the given range of the file out to
+  // storage, without waiting for them to get there.
+  void start_writeback(uint64_t offset, uint64_t size);
+
+  // Wait for the dirty pages in the given range of the file to get to
+  // storage, starting writeback on any which haven't yet.
+  void finish_writeback(uint64_t offset, uint64_t size);
+
+  // Wait for everything we've written to the file, and its metadata, to get
+  // to storage.
+  void sync();
+
+  // Cut the given range out of the file, moving everything after it down
+  // and shrinking the file, without copying any data.  Most file systems
+  // can only do this a whole number of blocks at a time.  Returns false,
+  // leaving the file as it was, if the file system can't do it.
+  bool collapse_range(uint64_t offset, uint64_t size);
+
+  // Copy size bytes, starting at in_offset in the given file, to this file,
+  // starting at out_offset.  The kernel does the copying, sharing the
+  // storage between the files instead if the file system can.  If the
+  // kernel can't copy between these files, we copy through a buffer.  This
+  // doesn't use or move either file's position.
+  void copy_from(
+      file_t &in, uint64_t in_offset, uint64_t out_offset, uint64_t size);
+
   // Return a newly constructed file object with the file open for reading.
   // If the file doesn't exist, this throws.
   static file_t open_ro(const std::string &path);
@@ -65,6 +145,15 @@ public:
   // writing.  If the file doesn't exist, it will be created.  If it does
   // exist, it will be truncated.
   static file_t open_rw(const std::string &path, mode_t mode = 0777);
+
+  // Return a newly constructed file object with the existing file open for
+  // reading and writing, leaving its contents alone.  If the file doesn't
+  // exist, this throws.
+  static file_t open_rw_existing(const std::string &path);
+
+  // Return a newly constructed file object with the given directory open,
+  // so it can be synced.  If the directory doesn't exist, this throws.
+  static file_t open_dir(const std::string &path);
 private:
 
   // All negative integers are illegal file descriptors, but we standardize
@@ -28,21 +28,43 @@ void print_usage() {
     std::cout << "| into eight shards of nearly equal size.                                      |" << std::endl;
     std::cout << "--------------------------------------------------------------------------------" << std::endl;
     std::cout << "---- OPT ------------------------------------------ USE CASE -------------------" << std::endl;
+    std::cout << "|    --consume  |  Join by using up the shards, needing little more space.     |" << std::endl;
+    std::cout << "|               |                                                              |" << std::endl;
+    std::cout << "|    --consume- |  Split by using up the file, needing room for about one      |" << std::endl;
+    std::cout << "|      source   |  shard more.  Run it again to resume if it's interrupted.    |" << std::endl;
+    std::cout << "|               |                                                              |" << std::endl;
+    std::cout << "|    -a         |  Align shard data to disk blocks, so --consume needn't copy. |" << std::endl;
+    std::cout << "|               |                                                              |" << std::endl;
+    std::cout << "|    -b         |  Most MB to leave dirty while writing, or 0 for no limit.    |" << std::endl;
+    std::cout << "|               |                                                              |" << std::endl;
+    std::cout << "|    -c         |  Checksum to use while splitting: crc32, crc32c or xxh64.    |" << std::endl;
+    std::cout << "|               |  xxh64 hashes every hole byte; use a crc for sparse files.   |" << std::endl;
+    std::cout << "|               |                                                              |" << std::endl;
     std::cout << "|    -d         |  Store shards in a new directory while splitting.            |" << std::endl;
     std::cout << "|               |                                                              |" << std::endl;
+    std::cout << "|    -f         |  Sync every file written, and its directory, before exiting. |" << std::endl;
+    std::cout << "|               |                                                              |" << std::endl;
     std::cout << "|    -i         |  Display information about a single shard.                   |" << std::endl;
     std::cout << "|               |                                                              |" << std::endl;
+    std::cout << "|    -m         |  Most MB of buffers to copy through, across all threads.     |" << std::endl;
+    std::cout << "|               |                                                              |" << std::endl;
     std::cout << "|    -n         |  Named prefix to use while creating folders and shards.      |" << std::endl;
     std::cout << "|               |                                                              |" << std::endl;
+    std::cout << "|    -o         |  Write shards to a directory. Repeat to stripe across many.  |" << std::endl;
+    std::cout << "|               |                                                              |" << std::endl;
     std::cout << "|    -s         |  Specify the maximum size of each shard in MB.               |" << std::endl;
     std::cout << "|               |                                                              |" << std::endl;
     std::cout << "|    -v         |  Enable verbose mode to see what's happening under the hood. |" << std::endl;
+    std::cout << "|               |                                                              |" << std::endl;
+    std::cout << "|    -w         |  Stripe by measured speed of each -o directory, not in turn. |" << std::endl;
     std::cout << "--------------------------------------------------------------------------------" << std::endl;
     std::cout << "----------------------------------  EXAMPLES  ----------------------------------" << std::endl;
     std::cout << "| $ chainsaw <file>                    |  Splits the file into eight shards.   |" << std::endl;
     std::cout << "|                                      |                                       |" << std::endl;
     std::cout << "| $ chainsaw <shards>                  |  Join shards back info a file.        |" << std::endl;
     std::cout << "|                                      |                                       |" << std::endl;
+    std::cout << "| $ chainsaw <dir> or '<dir>/foo@*'    |  Join all the shards found there.     |" << std::endl;
+    std::cout << "|                                      |                                       |" << std::endl;
     std::cout << "| $ chainsaw -s 100MB -n loves <file>  |  Make 100MB shards named 'loves7.10'  |" << std::endl;
     std::cout << "|                                      |                         (7 out of 10) |" << std::endl;
     std::cout << "| $ chainsaw -d <file>                 |  Store in a default-named directory.  |" << std::endl;
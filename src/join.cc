@@ -1,112 +1,763 @@
 #include "join.h"
 
+#include <algorithm>      // std::min
 #include <cstring>
+#include <deque>          // std::deque
+#include <exception>
+#include <functional>
 #include <iomanip>
 #include <map>            // std::map
+#include <set>            // std::set
+#include <system_error>   // std::system_error
 #include <stdexcept>
 #include <sstream>
-#include <tuple>
+#include <thread>
+#include <utility>
+#include <vector>
 
-#include "crc.h"
-#include "file.h"
+#include <stdio.h>        // rename()
+#include <sys/stat.h>     // stat()
+#include <unistd.h>       // unlink()
+
+#include "buffer_pool.h"
+#include "checksum.h"
+#include "discover.h"
+#include "pipe.h"
 #include "shard_hdr.h"
+#include "workers.h"
+
+// The directory part of a path, or "." if there isn't one.
+static std::string get_dir_name(const std::string &path) {
+  auto slash = path.rfind('/');
+  return slash == std::string::npos ? "." : path.substr(0, slash + 1);
+}
+
+// Read past size bytes of a source we can't necessarily seek within,
+// through a buffer from the pool.  There's usually nothing to skip, so we
+// only take a buffer if there is.
+static void skip(source_t &in, uint64_t size) {
+  if (!size) {
+    return;
+  }
+  auto buffer = buffer_pool_t::get_default().acquire();
+  while (size) {
+    auto piece_size =
+        static_cast<size_t>(std::min<uint64_t>(buffer.get_size(), size));
+    in.read_exactly(buffer.get_data(), piece_size);
+    size -= piece_size;
+  }  // while
+}
 
-// Open a file as a shard and read its header.
-static file_t open_shard(const std::string &path, shard_hdr_t &shard_hdr) {
+// Read the header from the start of a shard, leaving the source positioned
+// just after it.
+void read_shard_hdr(source_t &in, shard_hdr_t &shard_hdr) {
   try {
-    file_t in = file_t::open_ro(path);
-    uint64_t in_size;
-    mode_t mode;
-    std::tie(in_size, mode) = in.get_size_and_mode();
-    if (in_size < sizeof(shard_hdr_t)) {
+    // If we know how big the source is, make sure it's at least big enough
+    // to hold a header.
+    uint64_t in_size = in.get_size();
+    if (in_size < shard_hdr_t::v1_size) {
       throw std::runtime_error { "The file is too small." };
     }
+    // Read the version 1 part of the header, which every shard has, then
+    // the rest of it if the magic number says there's more.  A header from
+    // a later version may be bigger than ours, in which case we skip the
+    // parts we don't understand.
+    memset(&shard_hdr, 0, sizeof(shard_hdr_t));
     in.read_exactly(
-        reinterpret_cast<char *>(&shard_hdr), sizeof(shard_hdr_t));
-    if (shard_hdr.magic != shard_hdr_t::expected_magic ||
-        shard_hdr.shard_size != in_size) {
+        reinterpret_cast<char *>(&shard_hdr), shard_hdr_t::v1_size);
+    if (shard_hdr.magic == shard_hdr_t::expected_magic_v2) {
+      in.read_exactly(
+          reinterpret_cast<char *>(&shard_hdr) + shard_hdr_t::v1_size,
+          sizeof(shard_hdr_t) - shard_hdr_t::v1_size);
+      if (shard_hdr.hdr_size < sizeof(shard_hdr_t) ||
+          shard_hdr.hdr_size > shard_hdr.shard_size) {
+        throw std::runtime_error { "The file is not a shard." };
+      }
+      skip(in, shard_hdr.hdr_size - sizeof(shard_hdr_t));
+    } else if (shard_hdr.magic != shard_hdr_t::expected_magic) {
+      throw std::runtime_error { "The file is not a shard." };
+    }
+    shard_hdr.fix_up_v1();
+    if (!is_valid(shard_hdr.checksum_algo)) {
+      throw std::runtime_error {
+          "The shard uses a checksum algorithm we don't know." };
+    }
+    if (shard_hdr.shard_size < shard_hdr.hdr_size ||
+        (in_size != source_t::unknown_size &&
+         shard_hdr.shard_size != in_size)) {
       throw std::runtime_error { "The file is not a shard." };
     }
-    return in;
   } catch (...) {
     std::ostringstream msg;
-    msg << "Could not open " << std::quoted(path) << " as a shard.";
+    msg << "Could not open " << std::quoted(in.get_name()) << " as a shard.";
     std::throw_with_nested(std::runtime_error { msg.str() });
   }
 }
 
-// Join shards into a single file.
-int join(const std::vector<std::string> &file_names) {
-  // We must have some shards to work with.
-  if (file_names.empty()) {
-    throw std::runtime_error { "No shards to join." };
+// Read a sparse shard's extent table, which follows its header, and make
+// sure it makes sense.  The extents must be in order, must not overlap, must
+// fit within the shard's range of the original, and their data must exactly
+// fill the rest of the shard.
+static std::vector<shard_extent_t> read_extents(
+    source_t &in, const shard_hdr_t &shard_hdr) {
+  uint64_t table_size = shard_hdr.extent_count * sizeof(shard_extent_t);
+  if (shard_hdr.extent_count > shard_hdr.shard_size / sizeof(shard_extent_t) ||
+      shard_hdr.hdr_size + table_size > shard_hdr.shard_size) {
+    throw std::runtime_error { "The extent table is bad." };
+  }
+  std::vector<shard_extent_t> extents(shard_hdr.extent_count);
+  in.read_exactly(reinterpret_cast<char *>(extents.data()), table_size);
+  uint64_t offset = 0, data_size = 0;
+  for (const auto &extent: extents) {
+    if (extent.offset < offset ||
+        extent.offset > shard_hdr.logical_size ||
+        extent.size > shard_hdr.logical_size - extent.offset) {
+      throw std::runtime_error { "The extent table is bad." };
+    }
+    offset = extent.offset + extent.size;
+    data_size += extent.size;
+  }  // for
+  if (shard_hdr.hdr_size + table_size + data_size != shard_hdr.shard_size) {
+    throw std::runtime_error { "The extent table is bad." };
+  }
+  return extents;
+}
+
+// Copy the contents of a shard, which follow its header, to the output,
+// recreating any holes, and make sure they match the shard's checksum.
+static void copy_shard(
+    source_t &in, const shard_hdr_t &shard_hdr, sink_t &out) {
+  // A sparse shard tells us where its data goes; a dense shard is all
+  // data.
+  std::vector<shard_extent_t> extents;
+  if (shard_hdr.is_sparse()) {
+    extents = read_extents(in, shard_hdr);
+  } else if (shard_hdr.logical_size) {
+    extents.push_back({ 0, shard_hdr.logical_size });
+  }
+  auto buffer = buffer_pool_t::get_default().acquire();
+  checksum_t shard_sum { shard_hdr.checksum_algo };
+  uint64_t offset = 0;
+  for (const auto &extent: extents) {
+    // Skip over the hole before this extent, if there is one.
+    shard_sum.update_zeros(extent.offset - offset);
+    out.write_zeros(extent.offset - offset);
+    // Copy the extent's data.
+    uint64_t size = extent.size;
+    while (size) {
+      const char *data;
+      size_t piece_size = in.borrow_at_most(
+          buffer.get_data(),
+          static_cast<size_t>(std::min<uint64_t>(buffer.get_size(), size)),
+          data);
+      if (!piece_size) {
+        throw std::runtime_error { "Unexpected end of file." };
+      }
+      shard_sum.update(data, piece_size);
+      out.write_exactly(data, piece_size);
+      size -= piece_size;
+    }  // while
+    offset = extent.offset + extent.size;
+  }  // for
+  // Account for any hole at the end of the shard.
+  shard_sum.update_zeros(shard_hdr.logical_size - offset);
+  out.write_zeros(shard_hdr.logical_size - offset);
+  // There shouldn't be anything after the shard's data.
+  if (in.read_at_most(buffer.get_data(), 1)) {
+    throw std::runtime_error { "The shard is too long." };
   }
-  // Open the first shard and confirm we have the right number of file names.
-  shard_hdr_t master_shard_hdr;
-  file_t in = open_shard(file_names[0], master_shard_hdr);
-  if (file_names.size() != master_shard_hdr.shard_count) {
+  // Verify the checksum we computed for the shard against the one in the
+  // shard's header.
+  if (shard_hdr.shard_sum != shard_sum.get()) {
     std::ostringstream msg;
     msg
-        << "Got " << file_names.size() << " file name(s) but expected "
-        << master_shard_hdr.shard_count << " shard(s).";
+        << "The " << get_name(shard_hdr.checksum_algo)
+        << " checksum doesn't match.";
     throw std::runtime_error { msg.str() };
   }
-  // Build a map from shard idx to file name, ordered by idx.
-  std::map<uint16_t, std::string> shard_map;
-  shard_map[master_shard_hdr.shard_idx] = file_names[0];
-  shard_hdr_t shard_hdr;
-  for (size_t i = 1; i < file_names.size(); ++i) {
-    // Open the next file.  Make sure it matches the first one.
-    in = open_shard(file_names[i], shard_hdr);
+}
+
+// A sink which throws away whatever it's given, for when we only want to
+// check shards.
+class discard_sink_t final : public sink_t {
+public:
+
+  // Overrides.
+  virtual void write_exactly(const char *, size_t) override {}
+  virtual void write_zeros(uint64_t) override {}
+
+};  // discard_sink_t
+
+void check_shard(source_t &in, shard_hdr_t &shard_hdr) {
+  read_shard_hdr(in, shard_hdr);
+  try {
+    discard_sink_t out;
+    copy_shard(in, shard_hdr, out);
+  } catch (...) {
+    std::ostringstream msg;
+    msg << "Shard " << std::quoted(in.get_name()) << " is damaged.";
+    std::throw_with_nested(std::runtime_error { msg.str() });
+  }
+}
+
+// The most threads we'll use to read shard headers at once.  Reading a
+// header is mostly waiting on storage, so this can be well above the number
+// of cores.
+static const size_t max_hdr_thread_count = 32;
+
+// Read the header of every shard.  This means a round trip to storage for
+// each one, so, if the sources allow it, we have a pool of threads read them
+// at once.
+static std::vector<shard_hdr_t> read_shard_hdrs(
+    const std::vector<std::unique_ptr<source_t>> &shards) {
+  std::vector<shard_hdr_t> shard_hdrs(shards.size());
+  bool is_independent = true;
+  for (const auto &shard: shards) {
+    is_independent = is_independent && shard->is_independent();
+  }  // for
+  run_parallel(
+      shards.size(), is_independent ? max_hdr_thread_count : 1,
+      [&shards, &shard_hdrs](size_t i) {
+        read_shard_hdr(*shards[i], shard_hdrs[i]);
+      });
+  return shard_hdrs;
+}
+
+// Marks a shard idx we haven't found a shard for yet.
+static const size_t no_position = static_cast<size_t>(-1);
+
+// Make sure each shard matches the first one, and build a table, indexed by
+// shard idx, of each shard's position in the list.  Shards we don't have
+// are marked with no_position.
+static std::vector<size_t> get_shard_positions(
+    const std::vector<std::unique_ptr<source_t>> &shards,
+    const std::vector<shard_hdr_t> &shard_hdrs) {
+  const shard_hdr_t &master_shard_hdr = shard_hdrs[0];
+  std::vector<size_t> shard_positions(
+      master_shard_hdr.shard_count, no_position);
+  for (size_t i = 0; i < shards.size(); ++i) {
+    // Make sure each shard matches the first one.
+    const shard_hdr_t &shard_hdr = shard_hdrs[i];
     if (shard_hdr.shard_count   != master_shard_hdr.shard_count   ||
         shard_hdr.original_size != master_shard_hdr.original_size ||
-        shard_hdr.original_crc  != master_shard_hdr.original_crc  ||
+        shard_hdr.checksum_algo != master_shard_hdr.checksum_algo ||
+        shard_hdr.original_sum  != master_shard_hdr.original_sum  ||
+        shard_hdr.shard_idx < 1 ||
+        shard_hdr.shard_idx > shard_hdr.shard_count ||
         strcmp(shard_hdr.original_name, master_shard_hdr.original_name) != 0) {
       std::ostringstream msg;
-      msg << "Shard " << std::quoted(file_names[i]) << " doesn't match.";
+      msg
+          << "Shard " << std::quoted(shards[i]->get_name())
+          << " doesn't match.";
       throw std::runtime_error { msg.str() };
     }
-    // Add it to the map, barfing if we find a duplicate shard idx.
-    auto pair = shard_map.emplace(shard_hdr.shard_idx, file_names[i]);
-    if (!pair.second) {
+    // Add it to the table, barfing if we find a duplicate shard idx.
+    size_t &position = shard_positions[shard_hdr.shard_idx - 1];
+    if (position != no_position) {
       std::ostringstream msg;
-      msg << "Shard " << std::quoted(file_names[i]) << " is a duplicate.";
+      msg
+          << "Shard " << std::quoted(shards[i]->get_name())
+          << " is a duplicate.";
       throw std::runtime_error { msg.str() };
     }
+    position = i;
   }  // for
-  // Create the output file based on the first shard.
-  file_t out = file_t::open_rw(master_shard_hdr.original_name);
-  // Iterate through the map in order by shard idx, reading in each shard
-  // and writing to the output file.
-  uint32_t total_crc = 0;
-  for (const auto &pair: shard_map) {
-    // Append the contents of the shard to the output, computing the CRC
-    // values as we go.
-    in = open_shard(pair.second, shard_hdr);
-    char buffer[0x10000];
-    uint32_t shard_crc = 0;
-    for (;;) {
-      size_t piece_size = in.read_at_most(buffer, sizeof(buffer));
-      if (!piece_size) {
-        break;
-      }
-      update_crc(total_crc, buffer, piece_size);
-      update_crc(shard_crc, buffer, piece_size);
-      out.write_exactly(buffer, piece_size);
+  return shard_positions;
+}
+
+// The most lanes we'll read ahead with at once.  Shards in more directories
+// than this share lanes.
+static const size_t max_lane_count = 8;
+
+// One lane of a join, reading ahead with a thread of its own.  It reads its
+// shards, in order by shard idx, and sends their contents, less the headers,
+// through a pipe.
+struct lane_t final {
+
+  // Start out with a pipe which holds at most max_chunk_count chunks.
+  explicit lane_t(size_t max_chunk_count)
+      : pipe(max_chunk_count) {}
+
+  // The positions in the list of the shards this lane reads, in order by
+  // shard idx.
+  std::vector<size_t> shard_positions;
+
+  // The contents of the shards come through here.
+  pipe_t pipe;
+
+  // The thread which reads the shards.
+  std::thread thread;
+
+};  // lane_t
+
+// The body of a lane's thread.  Read each shard to its end, sending its
+// contents through the pipe.
+static void read_lane(
+    lane_t &lane, const std::vector<std::unique_ptr<source_t>> &shards,
+    const std::vector<shard_hdr_t> &shard_hdrs) {
+  try {
+    for (size_t position: lane.shard_positions) {
+      source_t &in = *shards[position];
+      uint16_t shard_idx = shard_hdrs[position].shard_idx;
+      for (;;) {
+        pipe_t::chunk_t chunk {
+            shard_idx, false, buffer_pool_t::get_default().acquire(), 0, 0 };
+        chunk.size =
+            in.read_at_most(chunk.buffer.get_data(), chunk.buffer.get_size());
+        if (!chunk.size) {
+          break;
+        }
+        lane.pipe.push(std::move(chunk));
+      }  // for
+      lane.pipe.push(pipe_t::chunk_t { shard_idx, true, {}, 0, 0 });
     }  // for
-    // Verify the CRC we computed for the shard against the one in the shard's
-    // header.
-    if (shard_hdr.shard_crc != shard_crc) {
+    lane.pipe.close();
+  } catch (...) {
+    // Pass the error along to the thread doing the joining.
+    lane.pipe.abort(std::current_exception());
+  }
+}
+
+// Join shards into a single file.
+void join(
+    const std::vector<std::unique_ptr<source_t>> &shards,
+    const make_join_sink_t &make_join_sink,
+    const std::vector<size_t> &shard_lanes) {
+  // We must have some shards to work with.
+  if (shards.empty()) {
+    throw std::runtime_error { "No shards to join." };
+  }
+  // Read the header of every shard.
+  auto shard_hdrs = read_shard_hdrs(shards);
+  // Confirm we have the right number of shards.
+  const shard_hdr_t &master_shard_hdr = shard_hdrs[0];
+  if (shards.size() != master_shard_hdr.shard_count) {
+    std::ostringstream msg;
+    msg
+        << "Got " << shards.size() << " shard(s) but expected "
+        << master_shard_hdr.shard_count << " shard(s).";
+    throw std::runtime_error { msg.str() };
+  }
+  // Build a table, indexed by shard idx, of each shard's position in the
+  // list.
+  auto shard_positions = get_shard_positions(shards, shard_hdrs);
+  // Sort the shards into lanes, if we have more than one.  Each lane
+  // reads ahead of us with its own thread.  Whatever happens, we stop the
+  // threads before we leave.
+  std::map<size_t, size_t> lane_map;
+  if (!shard_lanes.empty()) {
+    if (shard_lanes.size() != shards.size()) {
+      throw std::runtime_error { "Every shard needs a lane." };
+    }
+    for (size_t lane: shard_lanes) {
+      lane_map.emplace(lane, lane_map.size());
+    }  // for
+  }
+  // The read-ahead comes out of the budget for buffers.  Every lane's pipe,
+  // the chunk each lane is filling, and the two buffers we hold while
+  // copying must fit in it, or a lane could wait on us while we wait on it.
+  // If there isn't room for two lanes, with at least a chunk of read-ahead
+  // each, we read the shards ourselves.
+  size_t chunk_count = pipe_t::get_chunk_budget();
+  chunk_count = chunk_count > 2 ? chunk_count - 2 : 0;
+  size_t lane_count =
+      std::min(std::min(lane_map.size(), max_lane_count), chunk_count / 2);
+  std::deque<lane_t> lanes;
+  if (lane_count > 1) {
+    for (size_t i = 0; i < lane_count; ++i) {
+      lanes.emplace_back(chunk_count / lane_count - 1);
+    }  // for
+  }
+  for (size_t position: shard_positions) {
+    if (!lanes.empty()) {
+      lanes[lane_map[shard_lanes[position]] % lane_count].shard_positions
+          .push_back(position);
+    }
+  }  // for
+  struct stop_lanes_t final {
+    std::deque<lane_t> &lanes;
+    ~stop_lanes_t() {
+      for (auto &lane: lanes) {
+        lane.pipe.abort(std::make_exception_ptr(
+            std::runtime_error { "The join stopped." }));
+        if (lane.thread.joinable()) {
+          lane.thread.join();
+        }
+      }  // for
+    }
+  } stop_lanes { lanes };
+  for (auto &lane: lanes) {
+    lane.thread = std::thread {
+        read_lane, std::ref(lane), std::cref(shards), std::cref(shard_hdrs) };
+  }  // for
+  // Create the output based on the first shard.
+  auto out = make_join_sink(
+      master_shard_hdr.original_name, master_shard_hdr.original_size);
+  // If none of the shards have holes, neither will the output, so the sink
+  // can make room for all of it up front.
+  bool is_dense = true;
+  for (const auto &shard_hdr: shard_hdrs) {
+    is_dense = is_dense && !shard_hdr.is_sparse();
+  }  // for
+  if (is_dense) {
+    out->reserve(master_shard_hdr.original_size);
+  }
+  // Iterate through the table in order by shard idx, reading in each shard
+  // and writing to the output.
+  checksum_algo_t algo = master_shard_hdr.checksum_algo;
+  uint64_t total_sum = 0;
+  uint64_t out_size = 0;
+  for (size_t position: shard_positions) {
+    // Append the contents of the shard to the output, checking it as we
+    // go.  If the shard's lane is reading ahead, we get the contents from
+    // its pipe instead of directly.
+    const shard_hdr_t &shard_hdr = shard_hdrs[position];
+    std::unique_ptr<source_t> piped;
+    if (!lanes.empty()) {
+      piped.reset(new pipe_source_t {
+          lanes[lane_map[shard_lanes[position]] % lane_count].pipe,
+          shard_hdr.shard_idx, shards[position]->get_name() });
+    }
+    source_t &in = piped ? *piped : *shards[position];
+    try {
+      // The shard can't stand for more of the original than we have left.
+      if (shard_hdr.logical_size > master_shard_hdr.original_size - out_size) {
+        throw std::runtime_error { "The shard is too big." };
+      }
+      copy_shard(in, shard_hdr, *out);
+      total_sum = checksum_t::combine(
+          algo, total_sum, shard_hdr.shard_sum, shard_hdr.logical_size);
+      out_size += shard_hdr.logical_size;
+    } catch (...) {
       std::ostringstream msg;
-      msg << "Shard " << std::quoted(pair.second) << " is damaged.";
-      throw std::runtime_error { msg.str() };
+      msg << "Shard " << std::quoted(in.get_name()) << " is damaged.";
+      std::throw_with_nested(std::runtime_error { msg.str() });
     }
   }  // for
-  // Verify the size and CRC of the output.
-  auto out_size = out.seek(0, SEEK_CUR);
+  out->close();
+  // Verify the size and checksum of the output.
   if (out_size != master_shard_hdr.original_size ||
-      total_crc != master_shard_hdr.original_crc) {
+      total_sum != master_shard_hdr.original_sum) {
     throw std::runtime_error { "Output did not reconstruct correctly." };
   }
+}
+
+// Give each shard file a lane by its directory, as different directories
+// may well be on different disks.
+static std::vector<size_t> get_dir_lanes(
+    const std::vector<std::string> &file_names) {
+  std::map<std::string, size_t> dir_lanes;
+  std::vector<size_t> shard_lanes;
+  for (const auto &file_name: file_names) {
+    shard_lanes.push_back(
+        dir_lanes.emplace(get_dir_name(file_name), dir_lanes.size())
+            .first->second);
+  }  // for
+  return shard_lanes;
+}
+
+int join(
+    const std::vector<std::string> &file_names,
+    const writeback_t &writeback) {
+  // Open all the shard files for reading, each directory in its own lane.
+  auto shards = open_file_sources(file_names);
+  // The output goes in the current directory, under its original name.
+  join(
+      shards,
+      [&writeback](const std::string &original_name, uint64_t) {
+        return std::unique_ptr<sink_t> {
+            new file_sink_t { original_name, 0777, writeback } };
+      },
+      get_dir_lanes(file_names));
+  // Make sure the output's directory entry is safe too.
+  if (writeback.is_durable) {
+    file_t::open_dir(".").sync();
+  }
+  return EXIT_SUCCESS;
+}
+
+int join_found(const std::string &dir_or_glob, const writeback_t &writeback) {
+  return join(find_shards(dir_or_glob), writeback);
+}
+
+// Try to turn a dense shard into the start of the output, without copying
+// it, by renaming it and cutting off its header in place.  We rename it
+// first so that, if we're cut short in between, the output is still a whole
+// shard, which join_consume() recognizes next time.  Returns false, leaving
+// the shard alone, if it's on a different file system than the output or
+// its file system can't cut off the header.
+static bool collapse_shard(
+    const std::string &file_name, const shard_hdr_t &shard_hdr) {
+  struct stat shard_stat, dir_stat;
+  if (::stat(file_name.c_str(), &shard_stat) < 0 ||
+      ::stat(".", &dir_stat) < 0) {
+    throw std::system_error { errno, std::system_category() };
+  }
+  if (shard_stat.st_dev != dir_stat.st_dev) {
+    return false;
+  }
+  if (rename(file_name.c_str(), shard_hdr.original_name) < 0) {
+    throw std::system_error { errno, std::system_category() };
+  }
+  auto file = file_t::open_rw_existing(shard_hdr.original_name);
+  if (!file.collapse_range(0, shard_hdr.hdr_size)) {
+    if (rename(shard_hdr.original_name, file_name.c_str()) < 0) {
+      throw std::system_error { errno, std::system_category() };
+    }
+    return false;
+  }
+  file.sync();
+  return true;
+}
+
+// True if the file at the given path is shard 1 of the same original as
+// the given shard.
+static bool is_first_shard(
+    const std::string &path, const shard_hdr_t &master_shard_hdr) {
+  shard_hdr_t shard_hdr;
+  try {
+    file_source_t in { path };
+    read_shard_hdr(in, shard_hdr);
+  } catch (...) {
+    return false;
+  }
+  return
+      shard_hdr.shard_idx     == 1                              &&
+      shard_hdr.shard_count   == master_shard_hdr.shard_count   &&
+      shard_hdr.original_size == master_shard_hdr.original_size &&
+      shard_hdr.checksum_algo == master_shard_hdr.checksum_algo &&
+      shard_hdr.original_sum  == master_shard_hdr.original_sum  &&
+      strcmp(shard_hdr.original_name, master_shard_hdr.original_name) == 0;
+}
+
+// Check what an earlier call, cut short, left behind.  The output should
+// start with the data of the first done_count shards, each standing for as
+// much of the original as every other shard but the last, and the shards
+// we have should be whole.  Together, they must make up the original.
+// Returns how much of the output to keep; anything after that is still in
+// the shards.
+static uint64_t check_consumed(
+    const std::string &out_name, size_t done_count,
+    const std::vector<std::unique_ptr<source_t>> &shards,
+    const std::vector<shard_hdr_t> &shard_hdrs,
+    const std::vector<size_t> &shard_positions) {
+  const shard_hdr_t &next_shard_hdr = shard_hdrs[shard_positions[done_count]];
+  const shard_hdr_t &last_shard_hdr = shard_hdrs[shard_positions.back()];
+  checksum_algo_t algo = next_shard_hdr.checksum_algo;
+  uint64_t original_size = next_shard_hdr.original_size;
+  if (last_shard_hdr.logical_size > original_size) {
+    throw std::runtime_error { "The last shard is too big." };
+  }
+  uint64_t piece_size = done_count + 1 < shard_positions.size()
+      ? next_shard_hdr.logical_size
+      : (original_size - last_shard_hdr.logical_size) / done_count;
+  uint64_t left_size = 0;
+  for (size_t i = done_count; i < shard_positions.size(); ++i) {
+    left_size += shard_hdrs[shard_positions[i]].logical_size;
+  }  // for
+  uint64_t kept_size = piece_size * done_count;
+  if (kept_size + left_size != original_size) {
+    throw std::runtime_error { "The shards left don't fit the original." };
+  }
+  // Fold the checksums of the output's pieces, as split() figured them for
+  // the shards they came from, with those of the shards we have.
+  uint64_t sum = 0;
+  {
+    file_source_t out { out_name };
+    if (out.get_size() < kept_size) {
+      std::ostringstream msg;
+      msg << std::quoted(out_name) << " is too short to pick up from.";
+      throw std::runtime_error { msg.str() };
+    }
+    auto buffer = buffer_pool_t::get_default().acquire();
+    for (size_t i = 0; i < done_count; ++i) {
+      checksum_t piece_sum { algo };
+      uint64_t size = piece_size;
+      while (size) {
+        auto read_size = static_cast<size_t>(
+            std::min<uint64_t>(buffer.get_size(), size));
+        out.read_exactly(buffer.get_data(), read_size);
+        piece_sum.update(buffer.get_data(), read_size);
+        size -= read_size;
+      }  // while
+      sum = checksum_t::combine(algo, sum, piece_sum.get(), piece_size);
+    }  // for
+  }
+  for (size_t i = done_count; i < shard_positions.size(); ++i) {
+    source_t &in = *shards[shard_positions[i]];
+    const std::string &name = in.get_name();
+    try {
+      in.seek(0);
+      shard_hdr_t shard_hdr;
+      check_shard(in, shard_hdr);
+      sum = checksum_t::combine(
+          algo, sum, shard_hdr.shard_sum, shard_hdr.logical_size);
+    } catch (...) {
+      std::ostringstream msg;
+      msg << "Shard " << std::quoted(name) << " is damaged.";
+      std::throw_with_nested(std::runtime_error { msg.str() });
+    }
+  }  // for
+  if (sum != next_shard_hdr.original_sum) {
+    std::ostringstream msg;
+    msg
+        << std::quoted(out_name)
+        << " and the shards left don't make up the original.";
+    throw std::runtime_error { msg.str() };
+  }
+  return kept_size;
+}
+
+int join_consume(
+    const std::vector<std::string> &file_names,
+    const writeback_t &writeback) {
+  if (file_names.empty()) {
+    throw std::runtime_error { "No shards to join." };
+  }
+  // Read every shard's header, make sure they match, and put them in order
+  // by shard idx.  We open each shard just once, and read everything we
+  // need from it through that, so we need no more files open than join()
+  // does.
+  auto shards = open_file_sources(file_names);
+  auto shard_hdrs = read_shard_hdrs(shards);
+  auto shard_positions = get_shard_positions(shards, shard_hdrs);
+  const shard_hdr_t master_shard_hdr = shard_hdrs[0];
+  std::string out_name = master_shard_hdr.original_name;
+  // Any shards we don't have should be the first few, already consumed by
+  // an earlier call which was cut short.
+  size_t done_count = 0;
+  while (shard_positions[done_count] == no_position) {
+    ++done_count;
+  }  // while
+  for (size_t i = done_count; i < shard_positions.size(); ++i) {
+    if (shard_positions[i] == no_position) {
+      std::ostringstream msg;
+      msg
+          << "Shard " << (i + 1) << " of " << shard_positions.size()
+          << " is missing.";
+      throw std::runtime_error { msg.str() };
+    }
+  }  // for
+  // If the earlier call renamed shard 1 to be the output but didn't get to
+  // cut its header off, the output is still a whole shard, so put it back
+  // among the others and start over.
+  if (done_count == 1 && is_first_shard(out_name, master_shard_hdr)) {
+    std::ostringstream shard_name;
+    shard_name << out_name << "@1." << master_shard_hdr.shard_count;
+    if (rename(out_name.c_str(), shard_name.str().c_str()) < 0) {
+      throw std::system_error { errno, std::system_category() };
+    }
+    auto all_names = file_names;
+    all_names.push_back(shard_name.str());
+    shards.clear();
+    return join_consume(all_names, writeback);
+  }
+  file_t out;
+  uint64_t out_size = 0;
+  size_t next = done_count;
+  if (!done_count) {
+    // Check every shard, and that together they make up the original,
+    // before we destroy any of them.  This reads the shards but writes
+    // nothing.  It reads the headers again for itself, so we rewind.
+    for (auto &shard: shards) {
+      shard->seek(0);
+    }  // for
+    join(
+        shards,
+        [](const std::string &, uint64_t) {
+          return std::unique_ptr<sink_t> { new discard_sink_t };
+        },
+        get_dir_lanes(file_names));
+    // If we can, shard 1 becomes the output.  Otherwise, we start with an
+    // empty output and shard 1 is consumed like the rest.
+    const std::string &first_name = file_names[shard_positions[0]];
+    const shard_hdr_t &first_shard_hdr = shard_hdrs[shard_positions[0]];
+    if (!first_shard_hdr.is_sparse() &&
+        collapse_shard(first_name, first_shard_hdr)) {
+      out = file_t::open_rw_existing(out_name);
+      out_size = first_shard_hdr.logical_size;
+      next = 1;
+    } else {
+      out = file_t::open_rw(out_name);
+    }
+  } else {
+    // Pick up where the earlier call left off.  Anything in the output
+    // after the shards it finished is also in the shards we have, so it
+    // goes.
+    try {
+      out_size = check_consumed(
+          out_name, done_count, shards, shard_hdrs, shard_positions);
+      out = file_t::open_rw_existing(out_name);
+      out.truncate(out_size);
+    } catch (...) {
+      std::ostringstream msg;
+      msg
+          << "Could not pick up joining " << std::quoted(out_name)
+          << " where we left off.";
+      std::throw_with_nested(std::runtime_error { msg.str() });
+    }
+  }
+  // Now that we know the shards are good, put each one just past its
+  // header.
+  for (size_t i = 0; i < shards.size(); ++i) {
+    shards[i]->seek(shard_hdrs[i].hdr_size);
+  }  // for
+  // Append each remaining shard to the output, then delete it.  At most one
+  // shard's worth of data is ever in two places at once.  We close each
+  // shard once it's deleted, so the file system can have its space back.
+  for (; next < shard_positions.size(); ++next) {
+    size_t position = shard_positions[next];
+    const std::string &file_name = file_names[position];
+    const shard_hdr_t &shard_hdr = shard_hdrs[position];
+    try {
+      // The data follows the header and, in a sparse shard, the extent
+      // table, with the extents back to back.
+      std::vector<shard_extent_t> extents;
+      uint64_t data_offset = shard_hdr.hdr_size;
+      if (shard_hdr.is_sparse()) {
+        extents = read_extents(*shards[position], shard_hdr);
+        data_offset += extents.size() * sizeof(shard_extent_t);
+      } else if (shard_hdr.logical_size) {
+        extents.push_back({ 0, shard_hdr.logical_size });
+      }
+      // Copy the extents to where they belong, leaving holes between them.
+      // open_file_sources() only makes file sources, so we can copy from
+      // the file the shard's source has open.
+      file_t &in = static_cast<file_source_t &>(*shards[position]).get_file();
+      for (const auto &extent: extents) {
+        out.copy_from(in, data_offset, out_size + extent.offset, extent.size);
+        data_offset += extent.size;
+      }  // for
+      out_size += shard_hdr.logical_size;
+      out.truncate(out_size);
+      // Make sure the output holds the shard's data for good before we
+      // delete the shard.
+      out.sync();
+      if (unlink(file_name.c_str()) < 0) {
+        throw std::system_error { errno, std::system_category() };
+      }
+      shards[position].reset();
+    } catch (...) {
+      std::ostringstream msg;
+      msg << "Could not consume shard " << std::quoted(file_name) << '.';
+      std::throw_with_nested(std::runtime_error { msg.str() });
+    }
+  }  // for
+  // Make sure the directory entries we changed are safe too.
+  if (writeback.is_durable) {
+    file_t::open_dir(".").sync();
+    std::set<std::string> dir_names;
+    for (const auto &file_name: file_names) {
+      dir_names.insert(get_dir_name(file_name));
+    }  // for
+    for (const auto &dir_name: dir_names) {
+      file_t::open_dir(dir_name).sync();
+    }  // for
+  }
   return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
+
+int join_consume_found(
+    const std::string &dir_or_glob, const writeback_t &writeback) {
+  return join_consume(find_shards(dir_or_glob), writeback);
+}
@@ -1,7 +1,67 @@
 #pragma once
 
 #include <cstdint>
+#include <functional>
+#include <memory>
 #include <string>
 #include <vector>
 
-int join(const std::vector<std::string> &file_names);
\ No newline at end of file
+#include "shard_hdr.h"
+#include "sink.h"
+#include "source.h"
+
+// Makes the sink for the output of join(), given the name and size of the
+// original file, as recorded in the shards.
+using make_join_sink_t = std::function<
+    std::unique_ptr<sink_t> (const std::string &original_name,
+                             uint64_t original_size)>;
+
+// Read the header from the start of a shard, leaving the source positioned
+// just after it.  Throws if the source isn't a shard.
+void read_shard_hdr(source_t &in, shard_hdr_t &shard_hdr);
+
+// Read a whole shard, leaving its header in shard_hdr, and make sure its
+// contents match its checksum.  Throws if the shard is damaged.
+void check_shard(source_t &in, shard_hdr_t &shard_hdr);
+
+// Join shards, given in any order, back into the original, writing it to
+// the sink make_join_sink gives us.  Each shard is read once, from start to
+// end, so the sources needn't be able to seek.  Throws if anything goes
+// wrong, including if the output doesn't match the original.
+//
+// If shard_lanes is given, it holds a lane number for each shard, such as
+// one per disk the shards are on.  If there's more than one lane, each lane
+// gets a thread of its own to read its shards ahead of the output, so the
+// lanes all read at once.
+void join(
+    const std::vector<std::unique_ptr<source_t>> &shards,
+    const make_join_sink_t &make_join_sink,
+    const std::vector<size_t> &shard_lanes = {});
+
+// Join the shard files at the given paths, writing the output to the
+// current directory, and getting it to storage as writeback says.
+int join(
+    const std::vector<std::string> &file_names,
+    const writeback_t &writeback = {});
+
+// Join the shard files found in the given directory or matching the given
+// glob pattern, writing the output to the current directory.
+int join_found(
+    const std::string &dir_or_glob, const writeback_t &writeback = {});
+
+// Join the shard files at the given paths, as above, but consuming them, so
+// that we need room for little more than the output.  Once every shard has
+// been checked, shard 1 becomes the output, if the file system can cut off
+// its header in place, and the rest are copied onto the end of it, by the
+// kernel, which may just share their storage.  Each shard is deleted once
+// its data is safely in the output.  If we're cut short, calling this again
+// with the shards that are left checks what's already in the output against
+// them and carries on from there.
+int join_consume(
+    const std::vector<std::string> &file_names,
+    const writeback_t &writeback = {});
+
+// Join the shard files found in the given directory or matching the given
+// glob pattern, consuming them.
+int join_consume_found(
+    const std::string &dir_or_glob, const writeback_t &writeback = {});
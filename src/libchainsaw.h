@@ -0,0 +1,30 @@
+#pragma once
+
+// The public interface of the chainsaw library, for programs which want to
+// split and join without going through the chainsaw binary.  Include this and
+// link with every translation unit here except chainsaw.cc and help.cc.
+//
+// Splitting reads from a source_t and writes each shard to a sink_t made on
+// demand; joining reads the shards from source_t objects and writes the
+// original to a sink_t.  Files, blocks of memory, and callbacks all come as
+// ready-made sources and sinks, or you can derive your own.  For example, to
+// split a buffer you already hold into shards in memory:
+//
+//    memory_source_t in { data, size };
+//    std::vector<std::vector<char>> shards;
+//    split(in, "foo", max_shard_size,
+//        [&shards](uint16_t, uint16_t shard_count) {
+//          shards.resize(shard_count);
+//          ...return a memory_sink_t on the next element...
+//        });
+//
+// Everything reports errors by throwing, with the cause nested inside.
+
+#include "buffer_pool.h"
+#include "checksum.h"
+#include "discover.h"
+#include "join.h"
+#include "shard_hdr.h"
+#include "sink.h"
+#include "source.h"
+#include "split.h"
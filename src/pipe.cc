@@ -0,0 +1,155 @@
+#include "pipe.h"
+
+#include <algorithm>      // std::min
+#include <cstring>        // memcpy
+#include <stdexcept>      // std::runtime_error
+#include <utility>        // std::move
+
+// The number of buffers in the default pool, one for each chunk.
+size_t pipe_t::get_chunk_budget() {
+  return buffer_pool_t::get_default().get_buffer_count();
+}
+
+// Start out empty, able to hold at most max_chunk_count chunks.
+pipe_t::pipe_t(size_t max_chunk_count)
+    : max_chunk_count(max_chunk_count), is_closed(false) {}
+
+// Add a chunk to the end of the pipe, waiting for room if necessary.
+void pipe_t::push(chunk_t &&chunk) {
+  std::unique_lock<std::mutex> lock { mutex };
+  changed.wait(lock, [this] {
+    return chunks.size() < max_chunk_count || aborted_with;
+  });
+  check_aborted();
+  chunks.push_back(std::move(chunk));
+  changed.notify_all();
+}
+
+// Take a chunk from the front of the pipe, waiting for one if necessary.
+bool pipe_t::pop(chunk_t &chunk) {
+  std::unique_lock<std::mutex> lock { mutex };
+  changed.wait(lock, [this] {
+    return !chunks.empty() || is_closed || aborted_with;
+  });
+  check_aborted();
+  if (chunks.empty()) {
+    return false;
+  }
+  chunk = std::move(chunks.front());
+  chunks.pop_front();
+  changed.notify_all();
+  return true;
+}
+
+// Called by the producer when it has nothing more to push.
+void pipe_t::close() {
+  std::lock_guard<std::mutex> lock { mutex };
+  is_closed = true;
+  changed.notify_all();
+}
+
+// Called by either side when it fails.  Only the first failure sticks.
+void pipe_t::abort(std::exception_ptr ex) {
+  std::lock_guard<std::mutex> lock { mutex };
+  if (!aborted_with) {
+    aborted_with = ex;
+  }
+  changed.notify_all();
+}
+
+// Throw the exception we were aborted with, if any.
+void pipe_t::check_aborted() const {
+  if (aborted_with) {
+    std::rethrow_exception(aborted_with);
+  }
+}
+
+// Cache the pipe and the shard we're sending.
+pipe_sink_t::pipe_sink_t(pipe_t &pipe, uint16_t shard_idx)
+    : pipe(pipe) {
+  chunk.shard_idx = shard_idx;
+}
+
+// Gather bytes into the chunk, sending it along whenever its buffer fills
+// up.  We don't take a buffer for the chunk until we have something to put
+// in it.
+void pipe_sink_t::write_exactly(const char *buffer, size_t size) {
+  while (size) {
+    if (!chunk.buffer.get_data()) {
+      chunk.buffer = buffer_pool_t::get_default().acquire();
+    }
+    size_t piece_size = std::min(size, chunk.buffer.get_size() - chunk.size);
+    memcpy(chunk.buffer.get_data() + chunk.size, buffer, piece_size);
+    chunk.size += piece_size;
+    if (chunk.size == chunk.buffer.get_size()) {
+      flush(false);
+    }
+    buffer += piece_size;
+    size   -= piece_size;
+  }  // while
+}
+
+// Pass the hint along in the next chunk we send.
+void pipe_sink_t::reserve(uint64_t size) {
+  chunk.reserve_size = size;
+}
+
+// Send whatever we have left as the last chunk.
+void pipe_sink_t::close() {
+  flush(true);
+}
+
+// Send the chunk we've gathered and start a new one.
+void pipe_sink_t::flush(bool is_last) {
+  chunk.is_last = is_last;
+  uint16_t shard_idx = chunk.shard_idx;
+  pipe.push(std::move(chunk));
+  chunk = pipe_t::chunk_t { shard_idx, false, {}, 0, 0 };
+}
+
+// Cache the pipe and the shard we expect to receive.
+pipe_source_t::pipe_source_t(
+    pipe_t &pipe, uint16_t shard_idx, std::string name)
+    : source_t(std::move(name)), pipe(pipe), shard_idx(shard_idx),
+      offset(0) {}
+
+size_t pipe_source_t::read_at_most(char *buffer, size_t max_size) {
+  if (!fill()) {
+    return 0;
+  }
+  size_t read_size = std::min(max_size, chunk.size - offset);
+  memcpy(buffer, chunk.buffer.get_data() + offset, read_size);
+  offset += read_size;
+  return read_size;
+}
+
+// Lend out the chunk itself rather than copying it.  It stays put until the
+// next call.
+size_t pipe_source_t::borrow_at_most(
+    char *, size_t max_size, const char *&data) {
+  if (!fill()) {
+    return 0;
+  }
+  size_t read_size = std::min(max_size, chunk.size - offset);
+  data = chunk.buffer.get_data() + offset;
+  offset += read_size;
+  return read_size;
+}
+
+// Make sure we have bytes in our chunk to read, popping the next chunk if
+// we've used this one up.
+bool pipe_source_t::fill() {
+  while (offset == chunk.size) {
+    if (chunk.is_last) {
+      return false;
+    }
+    if (!pipe.pop(chunk)) {
+      throw std::runtime_error { "The pipe closed in the middle of a shard." };
+    }
+    if (chunk.shard_idx != shard_idx) {
+      throw std::runtime_error { "The pipe delivered the wrong shard." };
+    }
+    offset = 0;
+  }  // while
+  return true;
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <condition_variable>  // std::condition_variable
+#include <cstddef>             // size_t
+#include <cstdint>             // uint16_t
+#include <deque>               // std::deque
+#include <exception>           // std::exception_ptr
+#include <mutex>               // std::mutex
+#include <string>              // std::string
+
+#include "buffer_pool.h"
+#include "sink.h"
+#include "source.h"
+
+// A bounded queue of chunks of shard data, passed from one thread to
+// another.  The producer blocks when the pipe is full and the consumer
+// blocks when it's empty, so a fast producer can't get too far ahead.  If
+// either side fails, it aborts the pipe with its exception, which the other
+// side then gets rethrown at it.
+class pipe_t final {
+public:
+
+  // One chunk of a shard, held in a buffer from the default pool, so a full
+  // pipe counts against the budget for buffers.  The first size bytes of
+  // the buffer are the chunk's.  The last chunk of each shard is marked as
+  // such; it may be empty, with no buffer at all.  The first chunk may carry
+  // the size the producer expects the whole shard to be, as passed to
+  // sink_t::reserve(); otherwise that's zero.
+  struct chunk_t final {
+    uint16_t shard_idx = 0;
+    bool is_last = false;
+    buffer_pool_t::buffer_t buffer;
+    size_t size = 0;
+    uint64_t reserve_size = 0;
+  };  // chunk_t
+
+  // The number of chunks the default pool can hand out at once.  Whoever
+  // sizes pipes should leave room in it for the buffers everyone else
+  // needs, or a producer could wait on a consumer which is waiting on it.
+  static size_t get_chunk_budget();
+
+  // Start out empty, able to hold at most max_chunk_count chunks.
+  explicit pipe_t(size_t max_chunk_count = 8);
+
+  // Copying is not allowed.
+  pipe_t(const pipe_t &) = delete;
+  pipe_t &operator=(const pipe_t &) = delete;
+
+  // Add a chunk to the end of the pipe, waiting for room if necessary.
+  void push(chunk_t &&chunk);
+
+  // Take a chunk from the front of the pipe, waiting for one if necessary.
+  // Returns false if the pipe has been closed and there are no more chunks.
+  bool pop(chunk_t &chunk);
+
+  // Called by the producer when it has nothing more to push.
+  void close();
+
+  // Called by either side when it fails.  Anything waiting on the pipe,
+  // and any call after this, rethrows the given exception.
+  void abort(std::exception_ptr ex);
+
+private:
+
+  // Throw the exception we were aborted with, if any.  Call with the lock
+  // held.
+  void check_aborted() const;
+
+  // Covers everything below.
+  std::mutex mutex;
+
+  // Signaled when a chunk is pushed or popped, or when we're closed or
+  // aborted.
+  std::condition_variable changed;
+
+  // The chunks in the pipe, in order.
+  std::deque<chunk_t> chunks;
+
+  // The most chunks we'll hold at once.
+  size_t max_chunk_count;
+
+  // True once the producer calls close().
+  bool is_closed;
+
+  // Set by abort().
+  std::exception_ptr aborted_with;
+
+};  // pipe_t
+
+// A sink which writes one shard into a pipe, gathering the bytes into
+// chunks.  Closing the sink sends the last chunk.
+class pipe_sink_t final : public sink_t {
+public:
+
+  // Cache the pipe and the shard we're sending.
+  pipe_sink_t(pipe_t &pipe, uint16_t shard_idx);
+
+  // Overrides.
+  virtual void write_exactly(const char *buffer, size_t size) override;
+  virtual void reserve(uint64_t size) override;
+  virtual void close() override;
+
+private:
+
+  // Send the chunk we've gathered and start a new one.
+  void flush(bool is_last);
+
+  // The pipe we write into.
+  pipe_t &pipe;
+
+  // The chunk we're gathering.
+  pipe_t::chunk_t chunk;
+
+};  // pipe_sink_t
+
+// A source which reads one shard out of a pipe, ending when it gets the
+// shard's last chunk.
+class pipe_source_t final : public source_t {
+public:
+
+  // Cache the pipe and the shard we expect to receive.
+  pipe_source_t(pipe_t &pipe, uint16_t shard_idx, std::string name);
+
+  // Overrides.
+  virtual size_t read_at_most(char *buffer, size_t max_size) override;
+  virtual size_t borrow_at_most(
+      char *buffer, size_t max_size, const char *&data) override;
+
+private:
+
+  // Make sure we have bytes in our chunk to read, popping the next chunk if
+  // we've used this one up.  Returns false at the end of the shard.
+  bool fill();
+
+  // The pipe we read from.
+  pipe_t &pipe;
+
+  // The shard we expect.
+  uint16_t shard_idx;
+
+  // The chunk we're reading and our position within it.
+  pipe_t::chunk_t chunk;
+  size_t offset;
+
+};  // pipe_source_t
@@ -1,17 +1,64 @@
 #include "shard_hdr.h"
 
+#include <cstddef> // offsetof
 #include <iomanip> // std::quoted
 
 const uint32_t shard_hdr_t::expected_magic = 0xB007C8AD;
 
+const uint32_t shard_hdr_t::expected_magic_v2 = 0xB007C8AE;
+
+// The original header ended with the file name and four bytes of padding,
+// which is where flags now lives.
+const size_t shard_hdr_t::v1_size = offsetof(shard_hdr_t, flags) + 4;
+
+const uint32_t shard_hdr_t::sparse_flag = 0x1;
+
+size_t shard_hdr_t::get_size() const {
+  return magic == expected_magic_v2 ? hdr_size : v1_size;
+}
+
+void shard_hdr_t::set_version(size_t align_size) {
+  original_crc = static_cast<uint32_t>(original_sum);
+  shard_crc = static_cast<uint32_t>(shard_sum);
+  if (flags || checksum_algo != checksum_algo_t::crc32 || align_size) {
+    magic = expected_magic_v2;
+    hdr_size = sizeof(shard_hdr_t);
+    if (align_size) {
+      hdr_size = static_cast<uint32_t>(
+          (hdr_size + align_size - 1) / align_size * align_size);
+    }
+  } else {
+    magic = expected_magic;
+    hdr_size = v1_size;
+    logical_size = shard_size - v1_size;
+    extent_count = 0;
+  }
+}
+
+void shard_hdr_t::fix_up_v1() {
+  if (magic == expected_magic) {
+    flags = 0;
+    hdr_size = v1_size;
+    logical_size = shard_size - v1_size;
+    extent_count = 0;
+    checksum_algo = checksum_algo_t::crc32;
+    original_sum = original_crc;
+    shard_sum = shard_crc;
+  }
+}
+
 std::ostream &operator<<(std::ostream &strm, const shard_hdr_t &that) {
   return strm
       << "{ shard_idx: " << that.shard_idx
       << ", shard_count: " << that.shard_count
       << ", original_size: " << that.original_size
-      << ", original_crc: " << that.original_crc
+      << ", checksum_algo: " << get_name(that.checksum_algo)
+      << ", original_sum: " << that.original_sum
       << ", shard_size: " << that.shard_size
-      << ", shard_crc: " << that.shard_crc
+      << ", shard_sum: " << that.shard_sum
       << ", original_name: " << std::quoted(that.original_name)
+      << ", flags: " << that.flags
+      << ", logical_size: " << that.logical_size
+      << ", extent_count: " << that.extent_count
       << " }";
 }
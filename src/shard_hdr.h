@@ -1,11 +1,22 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 #include <ostream>
 
+#include "checksum.h"
+
 // This structure appears at the start of each chainsawed shard.  It contains
 // enough information, when combined with all the shards, to reconstitute the
 // original file.
+//
+// There are two versions of the header on disk, told apart by their magic
+// number.  A version 1 header holds everything up to and including
+// original_name (plus the padding after it) and is followed directly by the
+// shard's data.  A version 2 header holds all of the fields below, and says
+// how long it is in hdr_size, so later versions can grow it.  We only write a
+// version 2 header when a shard actually needs it, so ordinary shards remain
+// readable by older builds.
 struct shard_hdr_t final {
 
   // A magic number by which a shard may be distinguished from any other sort
@@ -18,23 +29,100 @@ struct shard_hdr_t final {
   // The size, in bytes, of the file that was chainsawed to form this shard.
   uint64_t original_size;
 
-  // The CRC of the file that was chainsawed to form this shard.
+  // The CRC of the file that was chainsawed to form this shard.  If the
+  // shard uses some other checksum algorithm, this is the low 32 bits of
+  // original_sum.
   uint32_t original_crc;
 
   // This size of this shard, in bytes, including the header.  A file whose
   // size doesn't match this value isn't a shard.
   uint64_t shard_size;
 
-  // The CRC of the contents of this shard, not including the header.
+  // The CRC of the contents of this shard, not including the header.  For a
+  // sparse shard, this is the CRC of the data as it appeared in the original
+  // file, holes and all, not of the bytes stored in the shard.  If the shard
+  // uses some other checksum algorithm, this is the low 32 bits of
+  // shard_sum.
   uint32_t shard_crc;
 
   // The name of the file that was chainsawed to form this shard.  This will
   // be null-terminated and padded with nulls.
   char original_name[256];
 
-  // The expected value for magic.
+  // Bit flags describing how the shard's contents are stored.  This sits in
+  // what used to be the padding at the end of a version 1 header, which was
+  // always written as zeros, so it reads as zero there too.
+  uint32_t flags;
+
+  // The size, in bytes, of the header as stored on disk.
+  uint32_t hdr_size;
+
+  // The number of bytes of the original file this shard stands for.  For a
+  // dense shard, this is just the shard size less the header.
+  uint64_t logical_size;
+
+  // The number of entries in the extent table following a sparse shard's
+  // header.
+  uint64_t extent_count;
+
+  // The checksum algorithm used for original_sum and shard_sum.  A version 1
+  // header doesn't have this, and uses CRC-32.
+  checksum_algo_t checksum_algo;
+
+  // Always zero, for now.
+  uint32_t reserved;
+
+  // The checksum of the file that was chainsawed to form this shard.  For
+  // XXH64, this isn't a hash of the file itself but the fold, with
+  // checksum_t::combine(), of the shard sums, in order.
+  uint64_t original_sum;
+
+  // The checksum of the contents of this shard, figured the same way as
+  // shard_crc.
+  uint64_t shard_sum;
+
+  // The expected value for magic in a version 1 header.
   static const uint32_t expected_magic;
 
+  // The expected value for magic in a version 2 header.
+  static const uint32_t expected_magic_v2;
+
+  // The size of a version 1 header on disk.
+  static const size_t v1_size;
+
+  // Set in flags if the shard is sparse.  A sparse shard's header is followed
+  // by extent_count shard_extent_t entries, in order by offset, and then by
+  // the data of each of those extents, back to back.  Everything in the
+  // shard's range of the original file outside of the extents is zeros.
+  static const uint32_t sparse_flag;
+
+  // The version 1 header size we use if magic says this is a version 1
+  // header, or the one we recorded if it's version 2.
+  size_t get_size() const;
+
+  // True if the shard stores an extent table rather than plain data.
+  bool is_sparse() const { return (flags & sparse_flag) != 0; }
+
+  // Choose the magic number and header size for the fields which have been
+  // filled in, and copy the sums into the CRC fields.  This picks the
+  // version 1 layout if nothing in the header needs version 2.  If
+  // align_size isn't zero, though, we always pick version 2 and pad the
+  // header to a multiple of align_size, so the data after it starts on a
+  // boundary.  Call this before writing the header out.
+  void set_version(size_t align_size = 0);
+
+  // Fill in the version 2 fields which a version 1 header doesn't store, so
+  // the rest of the program can ignore the difference.  Call this after
+  // reading the first v1_size bytes of a header and, if magic says this is
+  // version 2, the rest of it.
+  void fix_up_v1();
+
 };  // shard_hdr_t
 
-std::ostream &operator<<(std::ostream &strm, const shard_hdr_t &that);
\ No newline at end of file
+// One region of data in a sparse shard.  The offset is relative to the start
+// of the shard's range in the original file.
+struct shard_extent_t final {
+  uint64_t offset, size;
+};  // shard_extent_t
+
+std::ostream &operator<<(std::ostream &strm, const shard_hdr_t &that);
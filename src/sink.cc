@@ -0,0 +1,147 @@
+#include "sink.h"
+
+#include <algorithm>      // std::min
+#include <utility>        // std::move
+
+sink_t::~sink_t() = default;
+
+// By default, we write the zeros, a buffer at a time.
+void sink_t::write_zeros(uint64_t size) {
+  static const char zeros[0x10000] = { 0 };
+  while (size) {
+    auto piece_size =
+        static_cast<size_t>(std::min<uint64_t>(sizeof(zeros), size));
+    write_exactly(zeros, piece_size);
+    size -= piece_size;
+  }  // while
+}
+
+// By default, we ignore the hint.
+void sink_t::reserve(uint64_t) {}
+
+// By default, there's nothing to do.
+void sink_t::close() {}
+
+// Enough to keep a disk streaming without hogging the page cache.
+const uint64_t writeback_t::default_dirty_limit = 0x4000000;
+
+// Create the file at the given path, or truncate it if it exists.
+file_sink_t::file_sink_t(
+    const std::string &path, mode_t mode, const writeback_t &writeback)
+    : file(file_t::open_rw(path, mode)), writeback(writeback), size(0),
+      started_size(0), last_started_offset(0), last_started_size(0) {}
+
+// Enough for a header and its extent table, or more.
+const size_t file_sink_t::max_held_size = 0x1000;
+
+void file_sink_t::write_exactly(const char *buffer, size_t size) {
+  // Hold back a small write, in the hope of sending it with the next one.
+  if (held.size() + size <= max_held_size) {
+    held.insert(held.end(), buffer, buffer + size);
+    this->size += size;
+    return;
+  }
+  write_held(buffer, size);
+  this->size += size;
+  throttle();
+}
+
+// Write out whatever we're holding back, followed by the given buffer, in
+// one go.
+void file_sink_t::write_held(const char *buffer, size_t size) {
+  if (held.empty()) {
+    file.write_exactly_at(buffer, size, this->size);
+    return;
+  }
+  iovec iov[2] = {
+    { held.data(), held.size() },
+    { const_cast<char *>(buffer), size }
+  };
+  file.write_vector_at(iov, 2, this->size - held.size());
+  held.clear();
+}
+
+// Skip over the zeros.  Writing after that, or setting the size in close(),
+// leaves a hole behind.
+void file_sink_t::write_zeros(uint64_t size) {
+  if (size) {
+    write_held(nullptr, 0);
+    uint64_t data_size = this->size;
+    this->size += size;
+    // There's nothing in a hole to write back, so don't bother throttling
+    // the windows it covers.  Whatever we wrote before it, in the window it
+    // starts in, still needs writing back, though.
+    uint64_t window_size = writeback.dirty_limit / 2;
+    if (window_size && this->size - started_size >= window_size) {
+      if (data_size > started_size) {
+        start_writeback(started_size, data_size - started_size);
+      }
+      started_size = this->size - this->size % window_size;
+    }
+  }
+}
+
+// Preallocate the file.  The file's size grows only as we write, so a shard
+// cut short by a failure still looks cut short.
+void file_sink_t::reserve(uint64_t size) {
+  file.allocate(size);
+}
+
+// If we ended with a hole, the file isn't as big as it should be yet, so set
+// its size explicitly.  Then sync, if we're to be durable.
+void file_sink_t::close() {
+  write_held(nullptr, 0);
+  file.truncate(size);
+  if (writeback.is_durable) {
+    file.sync();
+  }
+}
+
+// Start writeback on each full window behind us, waiting for the one before
+// it to finish.
+void file_sink_t::throttle() {
+  uint64_t window_size = writeback.dirty_limit / 2;
+  if (!window_size) {
+    return;
+  }
+  while (size - started_size >= window_size) {
+    start_writeback(started_size, window_size);
+    started_size += window_size;
+  }  // while
+}
+
+// Wait for the last range we started on, then start on this one.
+void file_sink_t::start_writeback(uint64_t offset, uint64_t size) {
+  if (last_started_size) {
+    file.finish_writeback(last_started_offset, last_started_size);
+  }
+  file.start_writeback(offset, size);
+  last_started_offset = offset;
+  last_started_size = size;
+}
+
+// Cache the block of memory to append to.
+memory_sink_t::memory_sink_t(std::vector<char> &data)
+    : data(data) {}
+
+void memory_sink_t::write_exactly(const char *buffer, size_t size) {
+  data.insert(data.end(), buffer, buffer + size);
+}
+
+// Grow the block, which fills in with zeros.
+void memory_sink_t::write_zeros(uint64_t size) {
+  data.resize(data.size() + static_cast<size_t>(size));
+}
+
+// Make room in the block, so we don't copy it as it grows.
+void memory_sink_t::reserve(uint64_t size) {
+  data.reserve(data.size() + static_cast<size_t>(size));
+}
+
+// Cache the function.
+callback_sink_t::callback_sink_t(write_t write)
+    : write(std::move(write)) {}
+
+void callback_sink_t::write_exactly(const char *buffer, size_t size) {
+  write(buffer, size);
+}
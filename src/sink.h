@@ -0,0 +1,154 @@
+#pragma once
+
+#include <cstddef>        // size_t
+#include <cstdint>        // uint64_t
+#include <functional>     // std::function
+#include <string>         // std::string
+#include <vector>         // std::vector
+
+#include "file.h"
+
+// Somewhere split() and join() can put bytes.  A sink is written from start
+// to end, like a file being appended to; neither split() nor join() ever goes
+// back to change what it has written.
+class sink_t {
+public:
+
+  // Sinks are handled by pointer to the base, so the destructor is virtual.
+  virtual ~sink_t();
+
+  // Append exactly size bytes from buffer.
+  virtual void write_exactly(const char *buffer, size_t size) = 0;
+
+  // Append size zero bytes.  A sink which can leave a hole instead of
+  // writing the zeros should.  By default, we write the zeros.
+  virtual void write_zeros(uint64_t size);
+
+  // A hint, given before anything is written, that we expect to write size
+  // bytes in all, so the sink can make room for them up front.  By default,
+  // we ignore it.
+  virtual void reserve(uint64_t size);
+
+  // Called once, after everything has been written.  If this throws, the
+  // output is not to be trusted.  By default, there's nothing to do.
+  virtual void close();
+
+};  // sink_t
+
+// How a file sink gets what it writes out to storage.
+struct writeback_t final {
+
+  // The default for dirty_limit.
+  static const uint64_t default_dirty_limit;
+
+  // The most bytes we let sit dirty in the page cache, or in flight to
+  // storage, before we wait for some of them to get there.  Left to itself,
+  // the kernel lets gigabytes pile up and then writes them all in a burst,
+  // which stalls everything else using the disk.  Zero leaves it to the
+  // kernel anyway.
+  uint64_t dirty_limit = default_dirty_limit;
+
+  // If true, the sink syncs the file when it's closed, so that, once it
+  // closes, the data is safe even if the power goes out.
+  bool is_durable = false;
+
+};  // writeback_t
+
+// A sink which writes to a file, leaving holes where it's given zeros.  It
+// writes at explicit offsets, never using the file's position.  Small
+// writes, such as a shard's header, are held back and go out in the same
+// system call as the write after them.
+class file_sink_t final : public sink_t {
+public:
+
+  // Create the file at the given path, or truncate it if it exists.
+  explicit file_sink_t(
+      const std::string &path, mode_t mode = 0777,
+      const writeback_t &writeback = {});
+
+  // Overrides.
+  virtual void write_exactly(const char *buffer, size_t size) override;
+  virtual void write_zeros(uint64_t size) override;
+  virtual void reserve(uint64_t size) override;
+  virtual void close() override;
+
+private:
+
+  // The most bytes we hold back.
+  static const size_t max_held_size;
+
+  // Write out whatever we're holding back, followed by the given buffer.
+  void write_held(const char *buffer, size_t size);
+
+  // Start writeback on each full window behind us, waiting for the one
+  // before it to finish, so at most two windows are ever dirty or in
+  // flight.
+  void throttle();
+
+  // Start writeback on the given range, after waiting for the range we
+  // started on last time to finish.
+  void start_writeback(uint64_t offset, uint64_t size);
+
+  // The file we write to.
+  file_t file;
+
+  // See writeback_t.
+  writeback_t writeback;
+
+  // The number of bytes we've written or skipped over, including the ones
+  // we're holding back.
+  uint64_t size;
+
+  // The bytes we're holding back, which go at the end of the file.
+  std::vector<char> held;
+
+  // The number of bytes, from the start of the file, we've started
+  // writeback on or skipped over as holes.
+  uint64_t started_size;
+
+  // The range we started writeback on last, which we have yet to wait for.
+  uint64_t last_started_offset, last_started_size;
+
+};  // file_sink_t
+
+// A sink which appends to a block of memory owned by the caller.  The memory
+// must outlive the sink.
+class memory_sink_t final : public sink_t {
+public:
+
+  // Cache the block of memory to append to.
+  explicit memory_sink_t(std::vector<char> &data);
+
+  // Overrides.
+  virtual void write_exactly(const char *buffer, size_t size) override;
+  virtual void write_zeros(uint64_t size) override;
+  virtual void reserve(uint64_t size) override;
+
+private:
+
+  // The block of memory we append to.
+  std::vector<char> &data;
+
+};  // memory_sink_t
+
+// A sink which passes its bytes to a function, such as one which writes to
+// a socket.
+class callback_sink_t final : public sink_t {
+public:
+
+  // The function we call to write.  It must consume all size bytes or
+  // throw.
+  using write_t = std::function<void (const char *buffer, size_t size)>;
+
+  // Cache the function.
+  explicit callback_sink_t(write_t write);
+
+  // Overrides.
+  virtual void write_exactly(const char *buffer, size_t size) override;
+
+private:
+
+  // See write_t.
+  write_t write;
+
+};  // callback_sink_t
@@ -0,0 +1,199 @@
+#include "source.h"
+
+#include <algorithm>      // std::min
+#include <cstring>        // memcpy
+#include <iomanip>        // std::quoted
+#include <limits>         // std::numeric_limits
+#include <stdexcept>      // std::runtime_error
+#include <sstream>        // std::ostringstream
+#include <tuple>          // std::tie
+#include <utility>        // std::move
+
+const uint64_t source_t::unknown_size =
+    std::numeric_limits<uint64_t>::max();
+
+// Cache the name, which we use in error messages.
+source_t::source_t(std::string name)
+    : name(std::move(name)) {}
+
+source_t::~source_t() = default;
+
+// Read exactly size bytes from the source to the buffer.
+void source_t::read_exactly(char *buffer, size_t size) {
+  while (size) {
+    size_t read_size = read_at_most(buffer, size);
+    if (!read_size) {
+      throw std::runtime_error { "Unexpected end of file." };
+    }
+    buffer += read_size;
+    size   -= read_size;
+  }  // while
+}
+
+// By default, a source reads into the buffer.
+size_t source_t::borrow_at_most(
+    char *buffer, size_t max_size, const char *&data) {
+  data = buffer;
+  return read_at_most(buffer, max_size);
+}
+
+// The size of the source in bytes, or unknown_size if we can't tell
+// without reading it all.  By default, we can't tell.
+uint64_t source_t::get_size() {
+  return unknown_size;
+}
+
+// Move to a new position, relative to the start of the source.  By
+// default, sources can't seek, so this throws.
+void source_t::seek(uint64_t) {
+  std::ostringstream msg;
+  msg << "Can't seek within " << std::quoted(name) << '.';
+  throw std::runtime_error { msg.str() };
+}
+
+// By default, sources can't read at an offset.
+bool source_t::can_read_at() const {
+  return false;
+}
+
+// By default, sources can't read at an offset, so this throws.
+size_t source_t::borrow_at_most_at(char *, size_t, uint64_t, const char *&) {
+  std::ostringstream msg;
+  msg << "Can't read at an offset within " << std::quoted(name) << '.';
+  throw std::runtime_error { msg.str() };
+}
+
+// By default, we assume a source might share state with others.
+bool source_t::is_independent() const {
+  return false;
+}
+
+// Find the regions within the given range of the source which actually
+// hold data.  By default, a source has no holes.
+std::vector<shard_extent_t> source_t::find_extents(
+    uint64_t, uint64_t size) {
+  std::vector<shard_extent_t> extents;
+  if (size) {
+    extents.push_back({ 0, size });
+  }
+  return extents;
+}
+
+// Open the file at the given path for reading.
+file_source_t::file_source_t(const std::string &path)
+    : source_t(path), file(file_t::open_ro(path)), offset(0) {
+  std::tie(size, mode) = file.get_size_and_mode();
+}
+
+size_t file_source_t::read_at_most(char *buffer, size_t max_size) {
+  size_t read_size = file.read_at_most_at(buffer, max_size, offset);
+  offset += read_size;
+  return read_size;
+}
+
+uint64_t file_source_t::get_size() {
+  return size;
+}
+
+void file_source_t::seek(uint64_t offset) {
+  this->offset = offset;
+}
+
+// We read with pread(), which never moves anything, so any number of threads
+// can read at once.
+bool file_source_t::can_read_at() const {
+  return true;
+}
+
+size_t file_source_t::borrow_at_most_at(
+    char *buffer, size_t max_size, uint64_t offset, const char *&data) {
+  data = buffer;
+  return file.read_at_most_at(buffer, max_size, offset);
+}
+
+// Each file source has its own file descriptor.
+bool file_source_t::is_independent() const {
+  return true;
+}
+
+// Walk the range with SEEK_DATA and SEEK_HOLE, skipping the holes, if the
+// file has any.
+std::vector<shard_extent_t> file_source_t::find_extents(
+    uint64_t start, uint64_t size) {
+  std::vector<shard_extent_t> extents;
+  uint64_t end = start + size;
+  uint64_t offset = start;
+  while (offset < end) {
+    uint64_t data = file.find_data(offset);
+    if (data >= end) {
+      break;
+    }
+    uint64_t hole = std::min(file.find_hole(data), end);
+    extents.push_back({ data - start, hole - data });
+    offset = hole;
+  }  // while
+  return extents;
+}
+
+// Cache the block of memory to read from.
+memory_source_t::memory_source_t(
+    const void *data, size_t size, std::string name)
+    : source_t(std::move(name)),
+      data(static_cast<const char *>(data)), size(size), offset(0) {}
+
+size_t memory_source_t::read_at_most(char *buffer, size_t max_size) {
+  size_t read_size = std::min(max_size, size - offset);
+  memcpy(buffer, data + offset, read_size);
+  offset += read_size;
+  return read_size;
+}
+
+// Lend out the memory itself rather than copying it.
+size_t memory_source_t::borrow_at_most(
+    char *, size_t max_size, const char *&data) {
+  size_t read_size = std::min(max_size, size - offset);
+  data = this->data + offset;
+  offset += read_size;
+  return read_size;
+}
+
+uint64_t memory_source_t::get_size() {
+  return size;
+}
+
+// Memory never moves, so any number of threads can read it at once.
+bool memory_source_t::can_read_at() const {
+  return true;
+}
+
+// Lend out the memory itself, without moving our position.
+size_t memory_source_t::borrow_at_most_at(
+    char *, size_t max_size, uint64_t offset, const char *&data) {
+  if (offset >= size) {
+    return 0;
+  }
+  auto read_size =
+      static_cast<size_t>(std::min<uint64_t>(max_size, size - offset));
+  data = this->data + offset;
+  return read_size;
+}
+
+// Memory sources share nothing but read-only memory.
+bool memory_source_t::is_independent() const {
+  return true;
+}
+
+void memory_source_t::seek(uint64_t new_offset) {
+  if (new_offset > size) {
+    throw std::runtime_error { "Seek past the end of memory." };
+  }
+  offset = static_cast<size_t>(new_offset);
+}
+
+// Cache the function.
+callback_source_t::callback_source_t(read_t read, std::string name)
+    : source_t(std::move(name)), read(std::move(read)) {}
+
+size_t callback_source_t::read_at_most(char *buffer, size_t max_size) {
+  return read(buffer, max_size);
+}
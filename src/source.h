@@ -0,0 +1,182 @@
+#pragma once
+
+#include <cstddef>        // size_t
+#include <cstdint>        // uint64_t
+#include <functional>     // std::function
+#include <string>         // std::string
+#include <vector>         // std::vector
+
+#include "file.h"
+#include "shard_hdr.h"
+
+// Somewhere split() and join() can get bytes from.  A source is read from
+// start to end, like a file, but some sources also know their size and can
+// seek, which split() needs, because it makes two passes over its input.
+class source_t {
+public:
+
+  // The value get_size() returns if we don't know how big the source is.
+  static const uint64_t unknown_size;
+
+  // Cache the name, which we use in error messages.
+  explicit source_t(std::string name);
+
+  // Sources are handled by pointer to the base, so the destructor is
+  // virtual.
+  virtual ~source_t();
+
+  // Copying is not allowed.
+  source_t(const source_t &) = delete;
+  source_t &operator=(const source_t &) = delete;
+
+  // A name for the source, such as its path, by which the user will know it.
+  const std::string &get_name() const noexcept { return name; }
+
+  // Read at most max_size bytes from the source and store them in buffer.
+  // Return the actual number of bytes read, which is zero only at the end.
+  virtual size_t read_at_most(char *buffer, size_t max_size) = 0;
+
+  // Read exactly size bytes from the source to the buffer.
+  void read_exactly(char *buffer, size_t size);
+
+  // Like read_at_most(), except that, rather than always copying into the
+  // buffer, a source which already holds its bytes in memory may just point
+  // data at them.  Either way, data points at what we read when we return.
+  // By default, this reads into the buffer.
+  virtual size_t borrow_at_most(
+      char *buffer, size_t max_size, const char *&data);
+
+  // The size of the source in bytes, or unknown_size if we can't tell
+  // without reading it all.  By default, we can't tell.
+  virtual uint64_t get_size();
+
+  // Move to a new position, relative to the start of the source.  By
+  // default, sources can't seek, so this throws.
+  virtual void seek(uint64_t offset);
+
+  // True if borrow_at_most_at() works, so several threads may read from
+  // different parts of the source at once without seeking.  By default,
+  // this is false.
+  virtual bool can_read_at() const;
+
+  // Like borrow_at_most(), except that we read at the given offset, rather
+  // than at our position, which we leave alone.  By default, sources can't
+  // do this, so this throws.
+  virtual size_t borrow_at_most_at(
+      char *buffer, size_t max_size, uint64_t offset, const char *&data);
+
+  // True if this source can be read on one thread while other sources are
+  // read on others, as join() does when it reads shard headers.  A callback
+  // source might share state with the other callbacks behind our backs, so,
+  // by default, this is false.
+  virtual bool is_independent() const;
+
+  // Find the regions within the given range of the source which actually
+  // hold data.  The resulting extents are relative to start.  Anything not
+  // within an extent is a hole, which reads as zeros.  By default, a source
+  // has no holes, so this returns a single extent covering the whole range.
+  virtual std::vector<shard_extent_t> find_extents(
+      uint64_t start, uint64_t size);
+
+private:
+
+  // See get_name().
+  std::string name;
+
+};  // source_t
+
+// A source which reads from a file.  It knows the file's size, can seek, and
+// finds holes in sparse files.  It keeps its own position and reads with
+// pread(), so it never disturbs anyone else sharing the file.
+class file_source_t final : public source_t {
+public:
+
+  // Open the file at the given path for reading.
+  explicit file_source_t(const std::string &path);
+
+  // The mode bits of the file, so copies can have the same permissions.
+  mode_t get_mode() const noexcept { return mode; }
+
+  // The file we read from, so its data can be copied out of it directly.
+  file_t &get_file() noexcept { return file; }
+
+  // Overrides.
+  virtual size_t read_at_most(char *buffer, size_t max_size) override;
+  virtual uint64_t get_size() override;
+  virtual void seek(uint64_t offset) override;
+  virtual bool can_read_at() const override;
+  virtual size_t borrow_at_most_at(
+      char *buffer, size_t max_size, uint64_t offset,
+      const char *&data) override;
+  virtual bool is_independent() const override;
+  virtual std::vector<shard_extent_t> find_extents(
+      uint64_t start, uint64_t size) override;
+
+private:
+
+  // The file we read from.
+  file_t file;
+
+  // The size of the file and its mode bits, as of when we opened it.
+  uint64_t size;
+  mode_t mode;
+
+  // Our position within the file.
+  uint64_t offset;
+
+};  // file_source_t
+
+// A source which reads from a block of memory the caller already holds.  We
+// don't copy the memory, so it must outlive the source.
+class memory_source_t final : public source_t {
+public:
+
+  // Cache the block of memory to read from.
+  memory_source_t(const void *data, size_t size, std::string name = "memory");
+
+  // Overrides.
+  virtual size_t read_at_most(char *buffer, size_t max_size) override;
+  virtual size_t borrow_at_most(
+      char *buffer, size_t max_size, const char *&data) override;
+  virtual uint64_t get_size() override;
+  virtual void seek(uint64_t offset) override;
+  virtual bool can_read_at() const override;
+  virtual size_t borrow_at_most_at(
+      char *buffer, size_t max_size, uint64_t offset,
+      const char *&data) override;
+  virtual bool is_independent() const override;
+
+private:
+
+  // The block of memory we read from.
+  const char *data;
+  size_t size;
+
+  // Our position within the block.
+  size_t offset;
+
+};  // memory_source_t
+
+// A source which gets its bytes by calling a function, such as one which
+// reads from a socket.  It can't seek and doesn't know its size, so it's only
+// good for join().
+class callback_source_t final : public source_t {
+public:
+
+  // The function we call to read.  It has the same contract as
+  // read_at_most(): it fills in at most max_size bytes of the buffer and
+  // returns how many it filled in, returning zero only at the end.
+  using read_t = std::function<size_t (char *buffer, size_t max_size)>;
+
+  // Cache the function.
+  explicit callback_source_t(read_t read, std::string name = "callback");
+
+  // Overrides.
+  virtual size_t read_at_most(char *buffer, size_t max_size) override;
+
+private:
+
+  // See read_t.
+  read_t read;
+
+};  // callback_source_t
@@ -1,14 +1,31 @@
 #include "split.h"
 
+#include <algorithm>      // std::max
+#include <atomic>
+#include <chrono>
 #include <cstring>
+#include <deque>          // std::deque
+#include <exception>
+#include <functional>
+#include <iomanip>
 #include <stdexcept>
 #include <sstream>
-#include <tuple>
+#include <map>            // std::map
+#include <system_error>   // std::system_error
+#include <thread>
 #include <utility>
+#include <vector>
 
-#include "crc.h"
-#include "file.h"
+#include <stdio.h>        // sscanf()
+#include <unistd.h>       // unlink()
+
+#include "buffer_pool.h"
+#include "checksum.h"
+#include "discover.h"
+#include "join.h"
+#include "pipe.h"
 #include "shard_hdr.h"
+#include "workers.h"
 
 // Given a path, a shard index, and a shard count, return a new path that is
 // the name of the shard.  For example, for path="foo", idx=1, count=3, return
@@ -20,42 +37,136 @@ static std::string make_shard_name(
   return strm.str();
 }
 
-int split(const std::string &file_name, uint64_t max_shard_size) {
-  // Open the input file for read-only.
-  file_t in = file_t::open_ro(file_name);
-  // Get the size of the input file in bytes and the mode bits indicating
-  // the file's permissions.
-  uint64_t in_size;
-  mode_t mode;
-  std::tie(in_size, mode) = in.get_size_and_mode();
-  // Make a pass over the file to compute its CRC, then seek back to the
-  // start.
-  char buffer[0x10000];
-  uint32_t crc = 0;
-  for (;;) {
-    size_t size = in.read_at_most(buffer, sizeof(buffer));
-    if (!size) {
-      break;
+// Copy the extents of the given range of the input to the output, back to
+// back, and return the checksum of the whole range.  We only read the
+// extents holding data; the holes count as zeros in the checksum.  If out is
+// null, we just compute the checksum.  If the input can read at an offset,
+// we do that rather than seeking, so other threads may read it at the same
+// time.
+static uint64_t copy_extents(
+    source_t &in, sink_t *out, uint64_t start,
+    const std::vector<shard_extent_t> &extents, uint64_t size,
+    checksum_algo_t algo, char *buffer, size_t buffer_size) {
+  bool can_read_at = in.can_read_at();
+  checksum_t sum { algo };
+  uint64_t offset = 0;
+  for (const auto &extent: extents) {
+    sum.update_zeros(extent.offset - offset);
+    uint64_t in_offset = start + extent.offset;
+    if (!can_read_at) {
+      in.seek(in_offset);
     }
-    update_crc(crc, buffer, size);
+    uint64_t size_left = extent.size;
+    while (size_left) {
+      // Read at most a buffer's worth of bytes.  If the input is already in
+      // memory, we use it where it lies.
+      const char *data;
+      auto max_size =
+          static_cast<size_t>(std::min<uint64_t>(buffer_size, size_left));
+      size_t piece_size = can_read_at
+          ? in.borrow_at_most_at(buffer, max_size, in_offset, data)
+          : in.borrow_at_most(buffer, max_size, data);
+      if (!piece_size) {
+        throw std::runtime_error { "The input shrank." };
+      }
+      // Compute the checksum so far.
+      sum.update(data, piece_size);
+      // Write out exactly the number of bytes we read in.
+      if (out) {
+        out->write_exactly(data, piece_size);
+      }
+      // Decrement the number of bytes left to copy.
+      in_offset += piece_size;
+      size_left -= piece_size;
+    }  // while
+    offset = extent.offset + extent.size;
   }  // for
-  in.seek(0, SEEK_SET);
-  // The number of shards we'll make is based on the size of the input and
-  // the maximum size of each shard.
-  size_t big_shard_count = (in_size + max_shard_size - 1) / max_shard_size;
+  sum.update_zeros(size - offset);
+  return sum.get();
+}
+
+// Makes the sink for a shard, given its "x of y" designation and its size,
+// including the header.
+using open_shard_t = std::function<
+    std::unique_ptr<sink_t> (
+        uint16_t shard_idx, uint16_t shard_count, uint64_t shard_size)>;
+
+// The size of a shard's header, padded to a multiple of align_size, if
+// that isn't zero.  We let the header pick its own version, as it will when
+// we write it.
+static size_t get_hdr_size(
+    checksum_algo_t algo, bool is_sparse, size_t align_size) {
+  shard_hdr_t shard_hdr;
+  memset(&shard_hdr, 0, sizeof(shard_hdr_t));
+  shard_hdr.checksum_algo = algo;
+  shard_hdr.flags = is_sparse ? shard_hdr_t::sparse_flag : 0;
+  shard_hdr.set_version(align_size);
+  return shard_hdr.get_size();
+}
+
+// The most of the input which fits in a shard after the header.
+static uint64_t get_max_logical_size(
+    uint64_t max_shard_size, checksum_algo_t algo, size_t align_size) {
+  size_t dense_hdr_size = get_hdr_size(algo, false, align_size);
+  if (max_shard_size <= dense_hdr_size) {
+    throw std::runtime_error { "The maximum shard size is too small." };
+  }
+  return max_shard_size - dense_hdr_size;
+}
+
+// The number of shards we'll make of an input of the given size.
+static uint16_t get_shard_count(uint64_t in_size, uint64_t max_logical_size) {
+  size_t big_shard_count = (in_size + max_logical_size - 1) / max_logical_size;
   if (big_shard_count > 65535) {
     throw std::runtime_error { "Jesus, that's a big file you have there." };
   }
-  uint16_t shard_count = static_cast<uint16_t>(big_shard_count);
-  // Fill in a shard header with the information shared by all the shards.
-  shard_hdr_t shard_hdr;
+  return static_cast<uint16_t>(big_shard_count);
+}
+
+// The most threads we'll use to checksum the shards of an input at once.
+// Each one reads its own shards, at its own offsets, from the same input.
+static const size_t max_sum_thread_count = 8;
+
+// Make a pass over the input to compute the checksum of each of the first
+// shard_count shards.  Each shard but the last one of the input gets the
+// maximum amount of it; the last one gets whatever is left over.  If the
+// input is sparse, we only read the parts of it which hold data.  If the
+// input can read at an offset, we checksum several shards at once.
+static std::vector<uint64_t> sum_shards(
+    source_t &in, uint64_t in_size, uint64_t max_logical_size,
+    uint16_t shard_count, checksum_algo_t algo) {
+  std::vector<uint64_t> shard_sums(shard_count);
+  size_t thread_count = 1;
+  if (in.can_read_at()) {
+    thread_count = std::max(
+        1u, std::min<unsigned>(
+            std::thread::hardware_concurrency(), max_sum_thread_count));
+  }
+  run_parallel(
+      shard_count, thread_count,
+      [&](size_t i) {
+        auto buffer = buffer_pool_t::get_default().acquire();
+        uint64_t offset = i * max_logical_size;
+        uint64_t logical_size = std::min(max_logical_size, in_size - offset);
+        shard_sums[i] = copy_extents(
+            in, nullptr, offset, in.find_extents(offset, logical_size),
+            logical_size, algo, buffer.get_data(), buffer.get_size());
+      });
+  return shard_sums;
+}
+
+// Fill in a shard header with the information shared by all the shards.
+static void init_shard_hdr(
+    shard_hdr_t &shard_hdr, const std::string &original_name,
+    uint16_t shard_count, uint64_t in_size, checksum_algo_t algo,
+    uint64_t sum) {
   memset(&shard_hdr, 0, sizeof(shard_hdr_t));
-  shard_hdr.magic = shard_hdr_t::expected_magic;
   shard_hdr.shard_count = shard_count;
   shard_hdr.original_size = in_size;
-  shard_hdr.original_crc = crc;
+  shard_hdr.checksum_algo = algo;
+  shard_hdr.original_sum = sum;
   // Copy the file name into the header.
-  const char *name = file_name.c_str();
+  const char *name = original_name.c_str();
   const char *slash = strrchr(name, '/');
   if (slash) {
     name = slash + 1;
@@ -64,49 +175,664 @@ int split(const std::string &file_name, uint64_t max_shard_size) {
     throw std::runtime_error { "The file name was too long." };
   }
   strcpy(shard_hdr.original_name, name);
-  // Loop, starting at shard 1, until we created all the shards.
+}
+
+// Write one shard, standing for the part of the input starting at offset.
+// The header must already have everything but the fields describing how the
+// shard is stored, which we fill in.
+static void write_shard(
+    source_t &in, shard_hdr_t &shard_hdr, uint64_t offset, size_t align_size,
+    const open_shard_t &open_shard, char *buffer, size_t buffer_size) {
+  // Find out where the data is in this part of the input.  If it's all
+  // data, this is an ordinary shard.  If there are holes, the shard will
+  // be sparse, storing only the extents holding data.
+  uint64_t logical_size = shard_hdr.logical_size;
+  auto extents = in.find_extents(offset, logical_size);
+  bool is_sparse =
+      extents.size() != 1 || extents[0].size != logical_size;
+  uint64_t data_size = 0;
+  for (const auto &extent: extents) {
+    data_size += extent.size;
+  }  // for
+  // Fill in the rest of the header and write it out.  Writing it now,
+  // before we write anything else, means it will appear at the start of the
+  // shard.
+  shard_hdr.flags = is_sparse ? shard_hdr_t::sparse_flag : 0;
+  size_t hdr_size =
+      get_hdr_size(shard_hdr.checksum_algo, is_sparse, align_size);
+  if (is_sparse) {
+    shard_hdr.extent_count = extents.size();
+    shard_hdr.shard_size =
+        hdr_size + extents.size() * sizeof(shard_extent_t) + data_size;
+  } else {
+    shard_hdr.extent_count = 0;
+    shard_hdr.shard_size = hdr_size + logical_size;
+  }
+  shard_hdr.set_version(align_size);
+  // Get the sink for this shard, and let it know how big the shard will
+  // be, so it can make room.
+  auto out = open_shard(
+      shard_hdr.shard_idx, shard_hdr.shard_count, shard_hdr.shard_size);
+  out->reserve(shard_hdr.shard_size);
+  // A padded header is followed by zeros.
+  size_t known_size = std::min(hdr_size, sizeof(shard_hdr_t));
+  out->write_exactly(reinterpret_cast<const char *>(&shard_hdr), known_size);
+  out->write_zeros(hdr_size - known_size);
+  // A sparse shard has its extent table next.
+  if (is_sparse) {
+    out->write_exactly(
+        reinterpret_cast<const char *>(extents.data()),
+        extents.size() * sizeof(shard_extent_t));
+  }
+  // Copy the data in each extent of the input to the output one buffer at
+  // a time.  Make sure the input didn't change out from under us since we
+  // computed the checksum.
+  auto shard_sum = copy_extents(
+      in, out.get(), offset, extents, logical_size, shard_hdr.checksum_algo,
+      buffer, buffer_size);
+  if (shard_sum != shard_hdr.shard_sum) {
+    throw std::runtime_error { "The input changed while we split it." };
+  }
+  out->close();
+}
+
+// Split the input into shards, writing each one to the sink open_shard
+// gives us.
+static void split_shards(
+    source_t &in, const std::string &original_name, uint64_t max_shard_size,
+    checksum_algo_t algo, size_t align_size, const open_shard_t &open_shard) {
+  // Get the size of the input in bytes.
+  uint64_t in_size = in.get_size();
+  if (in_size == source_t::unknown_size) {
+    std::ostringstream msg;
+    msg
+        << "Can't split " << std::quoted(in.get_name())
+        << " because its size isn't known.";
+    throw std::runtime_error { msg.str() };
+  }
+  // The number of shards we'll make is based on the size of the input and
+  // the amount of it which fits in each shard after the header.
+  uint64_t max_logical_size =
+      get_max_logical_size(max_shard_size, algo, align_size);
+  uint16_t shard_count = get_shard_count(in_size, max_logical_size);
+  // Compute the checksum of each shard, and so of the whole thing.  Doing
+  // this now means each shard's header is complete before we write it, so
+  // we never have to go back and rewrite it.
+  auto shard_sums =
+      sum_shards(in, in_size, max_logical_size, shard_count, algo);
+  uint64_t sum = 0, offset = 0;
+  for (auto shard_sum: shard_sums) {
+    uint64_t logical_size = std::min(max_logical_size, in_size - offset);
+    sum = checksum_t::combine(algo, sum, shard_sum, logical_size);
+    offset += logical_size;
+  }  // for
+  shard_hdr_t shard_hdr;
+  init_shard_hdr(shard_hdr, original_name, shard_count, in_size, algo, sum);
+  // Loop, starting at shard 1, until we created all the shards, copying
+  // through a buffer from the pool.
+  auto buffer = buffer_pool_t::get_default().acquire();
+  offset = 0;
   for (uint16_t shard_idx = 1; shard_idx <= shard_count; ++shard_idx) {
-    // Open the hard file for read-write, creating the shard if necessary,
-    // using the same mode bits as the input file.
-    file_t out = file_t::open_rw(
-        make_shard_name(file_name, shard_idx, shard_count),
-        mode);
-    // The size of this shard will be the maximum size of any shard, or
-    // the number of bytes left in the input whichever is smaller.  This
-    // means each shard but the last one will be of max size, and the last
-    // one will just have whatever is left over.
-    size_t shard_size = std::min(
-        max_shard_size - sizeof(shard_hdr_t), in_size);
-    // Fill in the shard-specific information in the header (except for the
-    // CRC, which comes later), and write it out as-is.  Writing it now,
-    // before we write anything else, means it will appear at the start of
-    // the shard file.
     shard_hdr.shard_idx = shard_idx;
-    shard_hdr.shard_size = shard_size + sizeof(shard_hdr_t);
-    out.write_exactly(
-        reinterpret_cast<const char *>(&shard_hdr), sizeof(shard_hdr));
-    // Decrement the number of bytes left in the input.
-    in_size -= shard_size;
-    // Copy the input to the output one buffer at a time.  A buffer is any
-    // convenient size, here set to 64K.
-    crc = 0;
-    while (shard_size) {
-      // Read at most a buffer's worth of bytes.
-      size_t piece_size = in.read_at_most(
-          buffer, std::min(sizeof(buffer), shard_size));
-      // Compute the CRC of the shard so far.
-      update_crc(crc, buffer, piece_size);
-      // Write out exactly the number of bytes we read in.
-      out.write_exactly(buffer, piece_size);
-      // Decrement the number of bytes left to copy for this shard.
-      shard_size -= piece_size;
+    shard_hdr.shard_sum = shard_sums[shard_idx - 1];
+    shard_hdr.logical_size = std::min(max_logical_size, in_size - offset);
+    write_shard(
+        in, shard_hdr, offset, align_size, open_shard, buffer.get_data(),
+        buffer.get_size());
+    offset += shard_hdr.logical_size;
+  }  // for
+}
+
+void split(
+    source_t &in, const std::string &original_name, uint64_t max_shard_size,
+    const make_shard_sink_t &make_shard_sink, checksum_algo_t algo,
+    size_t align_size) {
+  split_shards(
+      in, original_name, max_shard_size, algo, align_size,
+      [&make_shard_sink](uint16_t shard_idx, uint16_t shard_count, uint64_t) {
+        return make_shard_sink(shard_idx, shard_count);
+      });
+}
+
+// One target of a striped split.  It has a thread of its own, which takes
+// the shards we assign to it from a pipe and writes them out.
+struct target_t final {
+
+  // Start out with a pipe which holds at most max_chunk_count chunks.
+  explicit target_t(size_t max_chunk_count)
+      : pipe(max_chunk_count) {}
+
+  // Makes the sinks for the shards we write.
+  const make_shard_sink_t *make_shard_sink;
+
+  // The shards we're to write come through here.
+  pipe_t pipe;
+
+  // The thread which writes our shards.
+  std::thread thread;
+
+  // Set by our thread if it fails.
+  std::exception_ptr error;
+
+  // The number of bytes assigned to us so far.  Only touched by the thread
+  // doing the splitting.
+  uint64_t assigned_size = 0;
+
+  // The number of bytes we've written and the time, in nanoseconds, we've
+  // spent writing them.  Updated by our thread as it goes, so the thread
+  // doing the splitting can tell how fast we are.
+  std::atomic<uint64_t> written_size { 0 }, write_time { 0 };
+
+};  // target_t
+
+// The body of a target's thread.  Write shards as they come out of the
+// pipe, until it's closed.
+static void write_target(target_t &target, uint16_t shard_count) {
+  try {
+    std::unique_ptr<sink_t> out;
+    pipe_t::chunk_t chunk;
+    while (target.pipe.pop(chunk)) {
+      // The first chunk of each shard tells us to make its sink.
+      if (!out) {
+        out = (*target.make_shard_sink)(chunk.shard_idx, shard_count);
+        if (chunk.reserve_size) {
+          out->reserve(chunk.reserve_size);
+        }
+      }
+      auto start = std::chrono::steady_clock::now();
+      out->write_exactly(chunk.buffer.get_data(), chunk.size);
+      if (chunk.is_last) {
+        out->close();
+        out.reset();
+      }
+      auto stop = std::chrono::steady_clock::now();
+      target.written_size += chunk.size;
+      target.write_time += static_cast<uint64_t>(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              stop - start).count());
     }  // while
-    // Fill in the shard CRC, rewind to the start of the shard, and write
-    // the complete header.
-    shard_hdr.shard_crc = crc;
-    out.seek(0, SEEK_SET);
-    out.write_exactly(
-        reinterpret_cast<const char *>(&shard_hdr), sizeof(shard_hdr));
+  } catch (...) {
+    // Stop the thread doing the splitting from sending us any more.
+    target.error = std::current_exception();
+    target.pipe.abort(target.error);
+  }
+}
+
+// Pick the target for a shard of the given size.
+static target_t &pick_target(
+    std::deque<target_t> &targets, stripe_t stripe, uint16_t shard_idx,
+    uint64_t shard_size) {
+  if (stripe == stripe_t::round_robin) {
+    return targets[(shard_idx - 1) % targets.size()];
+  }
+  // Measure the speed of each target which has written anything so far, in
+  // bytes per nanosecond.  A target we haven't measured yet is assumed to
+  // be as fast as the average, or, if we haven't measured any of them, all
+  // are assumed to be equally fast.
+  std::vector<double> speeds(targets.size(), 0);
+  double total_speed = 0;
+  size_t measured_count = 0;
+  for (size_t i = 0; i < targets.size(); ++i) {
+    uint64_t written_size = targets[i].written_size;
+    uint64_t write_time = targets[i].write_time;
+    if (written_size && write_time) {
+      speeds[i] = static_cast<double>(written_size) / write_time;
+      total_speed += speeds[i];
+      ++measured_count;
+    }
+  }  // for
+  double default_speed = measured_count ? total_speed / measured_count : 1;
+  // Pick the target which would finish writing this shard first, given what
+  // it already has to write.
+  target_t *best = nullptr;
+  double best_time = 0;
+  for (size_t i = 0; i < targets.size(); ++i) {
+    target_t &target = targets[i];
+    uint64_t backlog = target.assigned_size - target.written_size;
+    double time =
+        (backlog + shard_size) / (speeds[i] ? speeds[i] : default_speed);
+    if (!best || time < best_time) {
+      best = &target;
+      best_time = time;
+    }
+  }  // for
+  return *best;
+}
+
+void split(
+    source_t &in, const std::string &original_name, uint64_t max_shard_size,
+    const std::vector<make_shard_sink_t> &targets, stripe_t stripe,
+    checksum_algo_t algo, size_t align_size) {
+  if (targets.empty()) {
+    throw std::runtime_error { "No targets to split to." };
+  }
+  // With just one target, there's nothing to overlap, so we write directly
+  // rather than through a pipe.
+  if (targets.size() == 1) {
+    split(in, original_name, max_shard_size, targets[0], algo, align_size);
+    return;
+  }
+  // The chunks in flight come out of the budget for buffers.  Every
+  // target's pipe, the chunk each target is writing, and the two buffers we
+  // hold while copying must fit in it, or we could wait on a target while
+  // it waits on us.  If there isn't room for at least a chunk in each pipe,
+  // we write the shards ourselves, handing them out in turn.
+  size_t chunk_count = pipe_t::get_chunk_budget();
+  chunk_count = chunk_count > 2 ? chunk_count - 2 : 0;
+  if (chunk_count / targets.size() < 2) {
+    split_shards(
+        in, original_name, max_shard_size, algo, align_size,
+        [&targets](uint16_t shard_idx, uint16_t shard_count, uint64_t) {
+          return targets[(shard_idx - 1) % targets.size()](
+              shard_idx, shard_count);
+        });
+    return;
+  }
+  std::deque<target_t> striped_targets;
+  for (size_t i = 0; i < targets.size(); ++i) {
+    striped_targets.emplace_back(chunk_count / targets.size() - 1);
+    striped_targets.back().make_shard_sink = &targets[i];
+  }  // for
+  // The threads start when we know how many shards there are, which is when
+  // we're asked for the first one.  Whatever happens, we stop them before we
+  // leave.
+  bool is_started = false;
+  auto stop_threads = [&striped_targets](std::exception_ptr ex) {
+    for (auto &target: striped_targets) {
+      if (ex) {
+        target.pipe.abort(ex);
+      } else {
+        target.pipe.close();
+      }
+    }  // for
+    for (auto &target: striped_targets) {
+      if (target.thread.joinable()) {
+        target.thread.join();
+      }
+    }  // for
+  };
+  try {
+    split_shards(
+        in, original_name, max_shard_size, algo, align_size,
+        [&](uint16_t shard_idx, uint16_t shard_count, uint64_t shard_size) {
+          if (!is_started) {
+            for (auto &target: striped_targets) {
+              target.thread = std::thread {
+                  write_target, std::ref(target), shard_count };
+            }  // for
+            is_started = true;
+          }
+          target_t &target =
+              pick_target(striped_targets, stripe, shard_idx, shard_size);
+          target.assigned_size += shard_size;
+          return std::unique_ptr<sink_t> {
+              new pipe_sink_t { target.pipe, shard_idx } };
+        });
+  } catch (...) {
+    stop_threads(std::current_exception());
+    // If a target failed, its error is more interesting than the one the
+    // pipe handed back to us.
+    for (const auto &target: striped_targets) {
+      if (target.error) {
+        std::rethrow_exception(target.error);
+      }
+    }  // for
+    throw;
+  }
+  // Let the targets finish up, then report the first failure, if any.
+  stop_threads(nullptr);
+  for (const auto &target: striped_targets) {
+    if (target.error) {
+      std::rethrow_exception(target.error);
+    }
+  }  // for
+}
+
+int split(
+    const std::string &file_name, uint64_t max_shard_size,
+    const std::vector<std::string> &dir_names, stripe_t stripe,
+    checksum_algo_t algo, const writeback_t &writeback, bool is_aligned) {
+  // Open the input file for read-only.  Each shard will have the same mode
+  // bits as the input file.
+  file_source_t in { file_name };
+  mode_t mode = in.get_mode();
+  // Without any directories, the shards go next to the input.  Otherwise,
+  // each directory is a target, and the shards are named after the input
+  // file without its path.
+  auto slash = file_name.rfind('/');
+  // To align the shards' data, we pad their headers to the biggest block
+  // size of the file systems they go to.
+  size_t align_size = 0;
+  if (is_aligned) {
+    for (const auto &dir_name: dir_names) {
+      align_size = std::max<size_t>(
+          align_size, file_t::open_dir(dir_name).get_block_size());
+    }  // for
+    if (dir_names.empty()) {
+      align_size = file_t::open_dir(
+          slash == std::string::npos ? "." : file_name.substr(0, slash + 1))
+          .get_block_size();
+    }
+  }
+  if (dir_names.empty()) {
+    split(
+        in, file_name, max_shard_size,
+        [&file_name, mode, &writeback](
+            uint16_t shard_idx, uint16_t shard_count) {
+          // Open the shard file for read-write, creating it if necessary.
+          return std::unique_ptr<sink_t> {
+              new file_sink_t {
+                  make_shard_name(file_name, shard_idx, shard_count), mode,
+                  writeback } };
+        },
+        algo, align_size);
+  } else {
+    std::string base_name =
+        slash == std::string::npos ? file_name : file_name.substr(slash + 1);
+    std::vector<make_shard_sink_t> targets;
+    for (const auto &dir_name: dir_names) {
+      std::string path = dir_name + '/' + base_name;
+      targets.emplace_back(
+          [path, mode, &writeback](uint16_t shard_idx, uint16_t shard_count) {
+            return std::unique_ptr<sink_t> {
+                new file_sink_t {
+                    make_shard_name(path, shard_idx, shard_count), mode,
+                    writeback } };
+          });
+    }  // for
+    split(
+        in, file_name, max_shard_size, targets, stripe, algo, align_size);
+  }
+  // Each shard synced itself as it closed.  Make sure their directory
+  // entries are safe too.
+  if (writeback.is_durable) {
+    if (!dir_names.empty()) {
+      for (const auto &dir_name: dir_names) {
+        file_t::open_dir(dir_name).sync();
+      }  // for
+    } else if (slash != std::string::npos) {
+      file_t::open_dir(file_name.substr(0, slash + 1)).sync();
+    } else {
+      file_t::open_dir(".").sync();
+    }
+  }
+  return EXIT_SUCCESS;
+}
+
+// Read the "x of y" designation out of a shard's name.
+static void parse_shard_name(
+    const std::string &path, uint16_t &shard_idx, uint16_t &shard_count) {
+  auto at = path.rfind('@');
+  if (at == std::string::npos ||
+      sscanf(
+          path.c_str() + at + 1, "%hu.%hu", &shard_idx, &shard_count) != 2 ||
+      shard_idx < 1 || shard_idx > shard_count) {
+    std::ostringstream msg;
+    msg << std::quoted(path) << " isn't named like a shard.";
+    throw std::runtime_error { msg.str() };
+  }
+}
+
+// Find where the part of the original in the given shard ends.  We don't
+// trust the shard itself, which may be damaged, so we go by the header of
+// the shard after it, unless it's the last, in which case its own header is
+// all we have.
+static uint64_t get_shard_end(
+    const std::map<uint16_t, std::string> &found_paths, uint16_t shard_idx) {
+  auto next = found_paths.find(shard_idx + 1);
+  shard_hdr_t shard_hdr;
+  if (next == found_paths.end()) {
+    file_source_t shard { found_paths.at(shard_idx) };
+    read_shard_hdr(shard, shard_hdr);
+    return shard_hdr.original_size;
+  }
+  file_source_t shard { next->second };
+  read_shard_hdr(shard, shard_hdr);
+  if (shard_hdr.shard_idx == shard_hdr.shard_count) {
+    return shard_hdr.original_size - shard_hdr.logical_size;
+  }
+  return shard_idx * shard_hdr.logical_size;
+}
+
+int split_consume(
+    const std::string &file_name, uint64_t max_shard_size,
+    checksum_algo_t algo, const writeback_t &writeback, bool is_aligned) {
+  file_source_t in { file_name };
+  mode_t mode = in.get_mode();
+  uint64_t in_size = in.get_size();
+  auto slash = file_name.rfind('/');
+  std::string dir_name =
+      slash == std::string::npos ? "." : file_name.substr(0, slash + 1);
+  size_t align_size =
+      is_aligned ? file_t::open_dir(dir_name).get_block_size() : 0;
+  // Look for shards left by an earlier run which was cut short.  We make
+  // the shards last to first, so these must be the last few.  Each one was
+  // synced before we started the next, so only the first of them can be
+  // incomplete.
+  std::map<uint16_t, std::string> found_paths;
+  uint16_t shard_count = 0;
+  for (const auto &path: find_shards_of(file_name)) {
+    uint16_t shard_idx, found_count;
+    parse_shard_name(path, shard_idx, found_count);
+    if (shard_count && found_count != shard_count) {
+      std::ostringstream msg;
+      msg
+          << "There are shards of " << std::quoted(file_name)
+          << " from more than one split.";
+      throw std::runtime_error { msg.str() };
+    }
+    shard_count = found_count;
+    found_paths[shard_idx] = path;
+  }  // for
+  if (!found_paths.empty()) {
+    if (found_paths.rbegin()->first != shard_count ||
+        found_paths.size() != shard_count - found_paths.begin()->first + 1u) {
+      std::ostringstream msg;
+      msg
+          << "Some of the shards of " << std::quoted(file_name)
+          << " are missing, so we can't pick up where we left off.";
+      throw std::runtime_error { msg.str() };
+    }
+    // If the first of them doesn't check out, we were probably cut short
+    // while making it, and we'll make it again.  But we only throw it away
+    // if the source still holds its part of the original.  Otherwise, it's
+    // all that's left of that part, so we leave everything alone.
+    const auto &first_found = *found_paths.begin();
+    try {
+      file_source_t shard { first_found.second };
+      shard_hdr_t shard_hdr;
+      check_shard(shard, shard_hdr);
+    } catch (...) {
+      try {
+        if (in_size < get_shard_end(found_paths, first_found.first)) {
+          throw std::runtime_error {
+              "The source no longer holds its part of the original." };
+        }
+      } catch (...) {
+        std::ostringstream msg;
+        msg
+            << "Shard " << std::quoted(first_found.second)
+            << " is damaged, and we can't make it again.";
+        std::throw_with_nested(std::runtime_error { msg.str() });
+      }
+      if (unlink(first_found.second.c_str()) < 0) {
+        throw std::system_error { errno, std::system_category() };
+      }
+      found_paths.erase(found_paths.begin());
+    }
+  }
+  // Read the headers of the shards we have, which tell us about the
+  // original, and make sure they agree.
+  std::vector<shard_hdr_t> found_hdrs;
+  for (const auto &found: found_paths) {
+    file_source_t shard { found.second };
+    found_hdrs.emplace_back();
+    read_shard_hdr(shard, found_hdrs.back());
+    const shard_hdr_t &first = found_hdrs.front();
+    const shard_hdr_t &shard_hdr = found_hdrs.back();
+    if (shard_hdr.shard_idx     != found.first               ||
+        shard_hdr.shard_count   != shard_count               ||
+        shard_hdr.original_size != first.original_size       ||
+        shard_hdr.original_sum  != first.original_sum        ||
+        shard_hdr.checksum_algo != first.checksum_algo       ||
+        strcmp(shard_hdr.original_name, first.original_name) != 0) {
+      std::ostringstream msg;
+      msg << "Shard " << std::quoted(found.second) << " doesn't match.";
+      throw std::runtime_error { msg.str() };
+    }
   }  // for
+  // Work out how the original is divided.  If we have shards already, they
+  // decide, and the source has lost their parts of it.  Otherwise, we're
+  // starting fresh.
+  uint64_t original_size = in_size;
+  size_t first_found_idx = 0;
+  if (found_hdrs.empty()) {
+    shard_count = get_shard_count(
+        in_size, get_max_logical_size(max_shard_size, algo, align_size));
+    if (!shard_count) {
+      std::ostringstream msg;
+      msg << "There's nothing in " << std::quoted(file_name) << " to split.";
+      throw std::runtime_error { msg.str() };
+    }
+    first_found_idx = shard_count + 1u;
+  } else {
+    original_size = found_hdrs.front().original_size;
+    algo = found_hdrs.front().checksum_algo;
+    first_found_idx = found_hdrs.front().shard_idx;
+    // A padded header tells us how the shards were aligned.
+    uint32_t hdr_size = found_hdrs.front().hdr_size;
+    align_size = hdr_size > sizeof(shard_hdr_t) ? hdr_size : 0;
+  }
+  // Every shard but the last holds as much of the original as will fit, so
+  // the first of two or more shards we have tells us how much that is.  If
+  // we only have the last shard, that's whatever the others leave it.
+  uint64_t max_logical_size = 0;
+  if (found_hdrs.empty()) {
+    max_logical_size = get_max_logical_size(max_shard_size, algo, align_size);
+  } else if (found_hdrs.size() > 1) {
+    max_logical_size = found_hdrs.front().logical_size;
+  } else if (shard_count == 1) {
+    max_logical_size = original_size;
+  } else if (found_hdrs.back().logical_size <= original_size) {
+    max_logical_size =
+        (original_size - found_hdrs.back().logical_size) / (shard_count - 1);
+  }
+  if (!max_logical_size) {
+    std::ostringstream msg;
+    msg
+        << "The shards of " << std::quoted(file_name)
+        << " don't fit the original.";
+    throw std::runtime_error { msg.str() };
+  }
+  // The source should hold everything before the first shard we have.
+  uint64_t offset = std::min<uint64_t>(
+      (first_found_idx - 1) * max_logical_size, original_size);
+  if (!found_hdrs.empty() &&
+      (get_shard_count(original_size, max_logical_size) != shard_count ||
+       found_hdrs.back().logical_size !=
+           original_size - (shard_count - 1) * max_logical_size)) {
+    std::ostringstream msg;
+    msg
+        << "The shards of " << std::quoted(file_name)
+        << " don't fit the original.";
+    throw std::runtime_error { msg.str() };
+  }
+  // The source should hold everything before the first shard we have.  If
+  // we were cut short after making that shard but before cutting it off
+  // the source, the source holds its part too, which must match it.
+  // Anything else means the source isn't what we split, or was never
+  // consumed at all.
+  bool is_first_in_source = !found_hdrs.empty() &&
+      in_size == offset + found_hdrs.front().logical_size;
+  if (!found_hdrs.empty() && in_size != offset && !is_first_in_source) {
+    std::ostringstream msg;
+    msg
+        << "The shards of " << std::quoted(file_name)
+        << " don't fit what's left of it.  Has it changed, or was it never"
+        << " consumed?";
+    throw std::runtime_error { msg.str() };
+  }
+  // Compute the checksums of the shards we have yet to make, and of the
+  // first shard we have, if the source still holds it.  Along with the
+  // ones we have, they must add up to the original.
+  auto shard_sums = sum_shards(
+      in, original_size, max_logical_size,
+      static_cast<uint16_t>(first_found_idx - (is_first_in_source ? 0 : 1)),
+      algo);
+  if (is_first_in_source) {
+    if (shard_sums.back() != found_hdrs.front().shard_sum) {
+      std::ostringstream msg;
+      msg
+          << std::quoted(file_name)
+          << " doesn't match the shard made from the end of it.";
+      throw std::runtime_error { msg.str() };
+    }
+    shard_sums.pop_back();
+  }
+  for (const auto &shard_hdr: found_hdrs) {
+    shard_sums.push_back(shard_hdr.shard_sum);
+  }  // for
+  uint64_t sum = 0, shard_offset = 0;
+  for (auto shard_sum: shard_sums) {
+    uint64_t logical_size =
+        std::min(max_logical_size, original_size - shard_offset);
+    sum = checksum_t::combine(algo, sum, shard_sum, logical_size);
+    shard_offset += logical_size;
+  }  // for
+  if (!found_hdrs.empty() && sum != found_hdrs.front().original_sum) {
+    std::ostringstream msg;
+    msg
+        << std::quoted(file_name)
+        << " has changed since its last shards were made.";
+    throw std::runtime_error { msg.str() };
+  }
+  shard_hdr_t shard_hdr;
+  init_shard_hdr(
+      shard_hdr, file_name, shard_count, original_size, algo, sum);
+  // If we were cut short after making a shard but before cutting it off
+  // the source, finish cutting.
+  auto source = file_t::open_rw_existing(file_name);
+  if (in_size > offset) {
+    source.truncate(offset);
+  }
+  // Make each shard we have left, last to first.  Each one is synced, and
+  // read back to make sure it's good, before we cut its part off the
+  // source, so, whenever we stop, the source and the shards between them
+  // hold the whole original.
+  writeback_t durable = writeback;
+  durable.is_durable = true;
+  for (auto shard_idx = static_cast<uint16_t>(first_found_idx - 1);
+       shard_idx >= 1; --shard_idx) {
+    offset = (shard_idx - 1) * max_logical_size;
+    std::string path = make_shard_name(file_name, shard_idx, shard_count);
+    shard_hdr.shard_idx = shard_idx;
+    shard_hdr.shard_sum = shard_sums[shard_idx - 1];
+    shard_hdr.logical_size =
+        std::min(max_logical_size, original_size - offset);
+    {
+      // Give the buffer back before we check the shard, which takes one of
+      // its own.
+      auto buffer = buffer_pool_t::get_default().acquire();
+      write_shard(
+          in, shard_hdr, offset, align_size,
+          [&path, mode, &durable](uint16_t, uint16_t, uint64_t) {
+            return std::unique_ptr<sink_t> {
+                new file_sink_t { path, mode, durable } };
+          },
+          buffer.get_data(), buffer.get_size());
+    }
+    file_t::open_dir(dir_name).sync();
+    file_source_t shard { path };
+    shard_hdr_t check_hdr;
+    check_shard(shard, check_hdr);
+    source.truncate(offset);
+  }  // for
+  // Nothing is left of the source, so it goes.
+  if (unlink(file_name.c_str()) < 0) {
+    throw std::system_error { errno, std::system_category() };
+  }
+  if (writeback.is_durable) {
+    file_t::open_dir(dir_name).sync();
+  }
   return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
@@ -1,6 +1,82 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
+#include <functional>
+#include <memory>
 #include <string>
+#include <vector>
 
-int split(const std::string &file_name, uint64_t max_shard_size);
\ No newline at end of file
+#include "checksum.h"
+#include "sink.h"
+#include "source.h"
+
+// Makes the sink for a shard, given its "x of y" designation.  split() calls
+// this once per shard it sends this way, in order, and closes and destroys
+// each sink before asking for the next.
+using make_shard_sink_t = std::function<
+    std::unique_ptr<sink_t> (uint16_t shard_idx, uint16_t shard_count)>;
+
+// How split() spreads shards over more than one target.
+enum class stripe_t {
+
+  // Each target gets the next shard in turn.
+  round_robin,
+
+  // Each shard goes to the target we expect to finish writing it first,
+  // judging by how much each target has queued and how fast it has written
+  // so far, so faster targets get more shards.
+  weighted
+
+};  // stripe_t
+
+// Split the input into shards of at most max_shard_size bytes each, writing
+// each one to the sink make_shard_sink gives us.  The input must know its
+// size and be able to seek.  The original name is recorded in each shard, to
+// be used by join() to name its output, along with checksums of each shard
+// and of the whole input, made with the given algorithm, which join() uses
+// to verify its output.  If align_size isn't zero, each shard's header is
+// padded to a multiple of it, so the shard's data starts on a boundary, such
+// as a file system block, which lets join_consume() cut the header off in
+// place rather than copying the data.  Throws if anything goes wrong.
+void split(
+    source_t &in, const std::string &original_name, uint64_t max_shard_size,
+    const make_shard_sink_t &make_shard_sink,
+    checksum_algo_t algo = checksum_algo_t::crc32, size_t align_size = 0);
+
+// As above, but spreading the shards over several targets, such as
+// directories on different disks.  Each target gets a thread of its own to
+// make and write its shards, so the targets all write at once.  The
+// functions in targets are called from those threads.
+void split(
+    source_t &in, const std::string &original_name, uint64_t max_shard_size,
+    const std::vector<make_shard_sink_t> &targets, stripe_t stripe,
+    checksum_algo_t algo = checksum_algo_t::crc32, size_t align_size = 0);
+
+// Split the file at the given path.  The shards go into the given
+// directories, spread as stripe says, or next to the file if there are no
+// directories, and get to storage as writeback says.  If is_aligned is set,
+// the shards' data is aligned to the block size of the file systems they go
+// to.
+int split(
+    const std::string &file_name, uint64_t max_shard_size,
+    const std::vector<std::string> &dir_names = {},
+    stripe_t stripe = stripe_t::round_robin,
+    checksum_algo_t algo = checksum_algo_t::crc32,
+    const writeback_t &writeback = {}, bool is_aligned = false);
+
+// Split the file at the given path into shards next to it, consuming it, so
+// that we need room for little more than one shard beyond the file itself.
+// The shards are made last to first, and each one is synced and checked
+// before the file is cut short behind it, so, if we're interrupted, the
+// file and the shards made so far still hold the whole original.  Calling
+// this again on the same file picks up where we left off, using the shard
+// size, checksum algorithm and alignment the earlier call chose, as the
+// shards it made record them, whatever we're asked for this time.  We refuse
+// to go on, touching nothing, unless what's left of the file fits the shards
+// we find and, between them, they hold the whole original.  Once we're done,
+// the file is gone.
+int split_consume(
+    const std::string &file_name, uint64_t max_shard_size,
+    checksum_algo_t algo = checksum_algo_t::crc32,
+    const writeback_t &writeback = {}, bool is_aligned = false);
@@ -0,0 +1,54 @@
+#include "workers.h"
+
+#include <algorithm>      // std::min
+#include <atomic>         // std::atomic
+#include <exception>      // std::exception_ptr
+#include <system_error>   // std::system_error
+#include <thread>         // std::thread
+#include <vector>         // std::vector
+
+void run_parallel(
+    size_t count, size_t thread_count, const std::function<void (size_t)> &fn) {
+  // Each thread, including ours, takes the next i until there are none left
+  // or something has gone wrong.
+  std::atomic<size_t> next_i { 0 };
+  std::atomic<bool> has_failed { false };
+  std::vector<std::exception_ptr> errors(count);
+  auto work = [&] {
+    for (;;) {
+      size_t i = next_i++;
+      if (i >= count || has_failed) {
+        break;
+      }
+      try {
+        fn(i);
+      } catch (...) {
+        errors[i] = std::current_exception();
+        has_failed = true;
+      }
+    }  // for
+  };
+  // Start the helpers, if we need any, do our share, and wait for them.
+  std::vector<std::thread> threads;
+  thread_count = std::min(thread_count, count);
+  for (size_t i = 1; i < thread_count; ++i) {
+    // If we can't start as many threads as we'd like, we make do.
+    try {
+      threads.emplace_back(work);
+    } catch (const std::system_error &) {
+      break;
+    }
+  }  // for
+  work();
+  for (auto &thread: threads) {
+    thread.join();
+  }  // for
+  // Report the first failure, if any.
+  if (has_failed) {
+    for (const auto &error: errors) {
+      if (error) {
+        std::rethrow_exception(error);
+      }
+    }  // for
+  }
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <cstddef>        // size_t
+#include <functional>     // std::function
+
+// Call fn(i) for every i from 0 up to count, using at most thread_count
+// threads, including the calling one.  The calls happen in no particular
+// order.  If any of them throw, we stop handing out more work and, once the
+// calls in progress are done, rethrow the exception from the call with the
+// lowest i.
+void run_parallel(
+    size_t count, size_t thread_count, const std::function<void (size_t)> &fn);